@@ -0,0 +1,244 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+//Times the register access paths of a UIO client, or the discovery of its endpoints, normally against
+//a fake UIO tree made by scripts/make_fake_uio_tree.sh (scripts/run_bench.sh does both).
+//
+//usage: uio_bench ADDRESS_TABLE [NAME=VALUE ...]    (client options, as the URI arguments)
+//       uio_bench --discovery ROOT [NAME=VALUE ...] (ROOT of a fake tree, timed with and without the cache)
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <ProtocolUIO.hpp>
+
+namespace uhal {
+
+  //Friend of UIO, so the translation can be timed on its own
+  struct UIOBench {
+    //random registers spread over all the endpoints
+    static std::vector<uint32_t> randomAddresses(UIO & aClient, size_t aCount) {
+      std::vector<uint32_t> addrs;
+      std::vector<uioaxi::sUIODevice const *> devs;
+      for (std::map<uint32_t,uioaxi::sUIODevice>::const_iterator itDev = aClient.devices.begin();
+	   itDev != aClient.devices.end(); itDev++) {
+	aClient.lookupAddr(itDev->first); //(maps the endpoint of a lazy client, so its size is known)
+	devs.push_back(&(itDev->second));
+      }
+      srand(1);
+      for (size_t iAddr = 0; iAddr < aCount; iAddr++) {
+	uioaxi::sUIODevice const & dev = *devs[rand() % devs.size()];
+	addrs.push_back(dev.uhalAddr + (rand() % dev.size));
+      }
+      return addrs;
+    }
+
+    static uint64_t lookupTable(UIO & aClient, std::vector<uint32_t> const & aAddrs) {
+      uint64_t sum = 0;
+      for (size_t iAddr = 0; iAddr < aAddrs.size(); iAddr++) {
+	uioaxi::sUIOAddrEntry const & entry = aClient.lookupAddr(aAddrs[iAddr]);
+	sum += (uintptr_t) (entry.hw + (aAddrs[iAddr] - entry.uhalAddr));
+      }
+      return sum;
+    }
+
+    //what every access did before the flat table
+    static uint64_t lookupMap(UIO & aClient, std::vector<uint32_t> const & aAddrs) {
+      uint64_t sum = 0;
+      for (size_t iAddr = 0; iAddr < aAddrs.size(); iAddr++) {
+	uioaxi::sUIODevice const & dev = (--(aClient.devices.upper_bound(aAddrs[iAddr])))->second;
+	uint32_t offset = aAddrs[iAddr] - dev.uhalAddr;
+	if (offset >= dev.size) {
+	  return 0;
+	}
+	sum += (uintptr_t) (dev.hw + offset);
+      }
+      return sum;
+    }
+
+    static size_t endpoints(UIO & aClient) {
+      return aClient.devices.size();
+    }
+
+    static uioaxi::sUIODevice const & firstDevice(UIO & aClient) {
+      aClient.lookupAddr(aClient.devices.begin()->first);
+      return aClient.devices.begin()->second;
+    }
+  };
+
+}
+
+using namespace uhal;
+
+//results go here, so that the timed loops can't be optimised away
+static uint64_t volatile sink;
+
+static double secondsSince(std::chrono::steady_clock::time_point aStart) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - aStart).count();
+}
+
+static void benchLookup(UIO & client) {
+  size_t const lookups = 1000000;
+  std::vector<uint32_t> addrs = UIOBench::randomAddresses(client, lookups);
+  //a first pass of each warms the caches
+  if (UIOBench::lookupTable(client, addrs) != UIOBench::lookupMap(client, addrs)) {
+    printf("lookup:       the table and the map disagree\n");
+    return;
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  sink = UIOBench::lookupTable(client, addrs);
+  double tableTime = secondsSince(start);
+  start = std::chrono::steady_clock::now();
+  sink = UIOBench::lookupMap(client, addrs);
+  double mapTime = secondsSince(start);
+  printf("lookup:       table %6.2f ns   std::map %6.2f ns   per address (%zu random registers)\n",
+	 1e9*tableTime/lookups, 1e9*mapTime/lookups, lookups);
+}
+
+static void benchBlockRead(UIO & client) {
+  //whole endpoint at a time, readBlock + dispatch (into a ValVector) against readBlockInto
+  uioaxi::sUIODevice const & dev = UIOBench::firstDevice(client);
+  uint32_t const words = dev.size;
+  size_t const blocks = (size_t(256) << 20)/(words*sizeof(uint32_t)); //256MB each way
+  ClientInterface & uhalClient = client;
+  std::vector<uint32_t> buffer(words);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t iBlock = 0; iBlock < blocks; iBlock++) {
+    ValVector<uint32_t> block = uhalClient.readBlock(dev.uhalAddr, words);
+    uhalClient.dispatch();
+    sink = block[words-1];
+  }
+  double readBlockTime = secondsSince(start);
+  start = std::chrono::steady_clock::now();
+  for (size_t iBlock = 0; iBlock < blocks; iBlock++) {
+    client.readBlockInto(dev.uhalAddr, buffer.data(), words);
+    sink = buffer[words-1];
+  }
+  double readBlockIntoTime = secondsSince(start);
+  double megabytes = double(blocks)*words*sizeof(uint32_t)/1e6;
+  printf("block read:   readBlock %8.1f MB/s   readBlockInto %8.1f MB/s   (%u word blocks)\n",
+	 megabytes/readBlockTime, megabytes/readBlockIntoTime, words);
+}
+
+//Average time to build a client, in us
+static double timeConstruction(URI const & aUri, size_t aClients, size_t & aEndpoints) {
+  double total = 0;
+  for (size_t iClient = 0; iClient < aClients; iClient++) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::unique_ptr<UIO> client(new UIO("uio_bench", aUri));
+    total += secondsSince(start);
+    aEndpoints = UIOBench::endpoints(*client);
+  }
+  return 1e6*total/aClients;
+}
+
+static void benchDiscovery(std::string const & aRoot, URI uri) {
+  //the whole tree through the URI arguments, which override the UIOUHAL_*_ROOT environment
+  size_t const clients = 20;
+  uri.mHostname = aRoot + "/address_table.xml";
+  uri.mArguments.push_back(std::make_pair(std::string("dev_root"),   aRoot + "/dev"));
+  uri.mArguments.push_back(std::make_pair(std::string("sysfs_root"), aRoot + "/sys/class/uio"));
+  uri.mArguments.push_back(std::make_pair(std::string("dt_root"),    aRoot + "/proc/device-tree"));
+
+  //how crowded the fake /dev is
+  size_t devEntries = 0;
+  DIR * dev = opendir((aRoot + "/dev").c_str());
+  if (dev != NULL) {
+    for (struct dirent * entry = readdir(dev); entry != NULL; entry = readdir(dev)) {
+      devEntries += (entry->d_name[0] != '.') ? 1 : 0;
+    }
+    closedir(dev);
+  }
+
+  size_t endpoints = 0;
+  URI uncached = uri;
+  uncached.mArguments.push_back(std::make_pair(std::string("cache"), std::string("0")));
+  double uncachedTime = timeConstruction(uncached, clients, endpoints);
+
+  //the first client writes the cache, the timed ones read it
+  URI cached = uri;
+  cached.mArguments.push_back(std::make_pair(std::string("cache"), aRoot + "/cache"));
+  timeConstruction(cached, 1, endpoints);
+  double cachedTime = timeConstruction(cached, clients, endpoints);
+
+  printf("discovery:    no cache %9.1f us   cache %9.1f us   per client (%zu endpoints, %zu /dev entries)\n",
+	 uncachedTime, cachedTime, endpoints, devEntries);
+}
+
+int main(int argc, char ** argv) {
+  bool discovery = (argc > 1) && (0 == strcmp(argv[1], "--discovery"));
+  int firstArg = discovery ? 2 : 1;
+  if (argc <= firstArg) {
+    fprintf(stderr, "usage: %s ADDRESS_TABLE [NAME=VALUE ...]\n"
+	    "       %s --discovery ROOT [NAME=VALUE ...]\n", argv[0], argv[0]);
+    return 1;
+  }
+  URI uri;
+  uri.mHostname = argv[firstArg];
+  for (int iArg = firstArg+1; iArg < argc; iArg++) {
+    std::string arg(argv[iArg]);
+    size_t equals = arg.find('=');
+    uri.mArguments.push_back(std::make_pair(arg.substr(0, equals),
+					    (equals == std::string::npos) ? std::string("1") : arg.substr(equals+1)));
+  }
+  if (discovery) {
+    benchDiscovery(uri.mHostname, uri);
+    return 0;
+  }
+  UIO client("uio_bench", uri);
+
+  benchLookup(client);
+  benchBlockRead(client);
+  return 0;
+}
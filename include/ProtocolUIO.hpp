@@ -50,6 +50,13 @@
 #include <uhal/ValMem.hpp>
 #include "uhal/log/exception.hpp"
 #include <signal.h> //for handling of SIG_BUS signals
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <atomic>
 
 /*
   The kernel patch would allow the device-tree property "linux,uio-name" to override the default label of uio devices.
@@ -59,10 +66,85 @@
 
 namespace uioaxi {
 
+  //Register/endpoint attributes taken from the address table
+  enum eUIORegFlags{
+    REG_SIDE_EFFECT = 0x1, //writes have side effects (FIFO ports, strobes): never squashed or merged
+    REG_NO_READBACK = 0x2, //RMWs return the value they wrote instead of reading the register back
+    REG_IRQ         = 0x4  //the endpoint's interrupt fires when the register changes (UIO::waitFor sleeps on it)
+  };
+
+
+  //One open+mmap of a /dev/uioN, shared by every UIO client in the process that uses the device
+  struct sUIOMapping{
+    sUIOMapping();
+    ~sUIOMapping();
+    int fd;
+    uint32_t volatile * hw;
+    size_t bytes;
+    uint32_t mapIndex;
+    std::string devPath; //the real /dev/uioN (symlinks resolved)
+    //held across each read-modify-write of a register of the device, by every client.  Shared by all the
+    //mappings of the device, as a client that needs more of it than is mapped so far maps it again
+    std::shared_ptr<std::mutex> rmwLock;
+  };
+
+  //Interrupt state of an endpoint, opened on first use.  Every client opens its own fd for this:
+  //the uio driver tracks which interrupts a reader has seen per open file, and the mapping's fd is shared
+  struct sUIOIRQ{
+    sUIOIRQ();
+    ~sUIOIRQ();
+    int fd;
+    uint32_t count;     //interrupt count at the last read
+    bool     countRead; //count is valid (the uio driver's count starts wherever it is)
+    uint32_t missed;    //interrupts that fired while the last one was still being handled
+    std::function<void(std::string const &, uint32_t)> handler; //set with UIO::addIRQHandler
+    uint32_t ringCount;  //filled by the pending io_uring read (irq_backend=io_uring)
+    uint32_t ringEnable; //written by the io_uring re-arm
+    bool     ringReading; //an io_uring read of fd is in flight
+  };
+
+  //Minimal io_uring submission/completion ring on the raw syscalls (In ProtocolUIO_uring.cpp).
+  //Requests are queued with the queue calls and all go to the kernel with the next submit.
+  struct sUIORing{
+    sUIORing();
+    ~sUIORing();
+    int  setup(uint32_t aEntries); //0 or an errno (ENOSYS without io_uring in the kernel or its headers)
+    bool queueRead   (int aFd, void * aBuffer, uint32_t aBytes, uint64_t aTag, bool aLinked = false);
+    bool queueWrite  (int aFd, void const * aBuffer, uint32_t aBytes, uint64_t aTag, bool aLinked = false);
+    bool queueTimeout(uint32_t aMilliseconds, uint64_t aTag);
+    bool queueCancel (uint64_t aTarget, uint64_t aTag);
+    bool queueTimeoutRemove(uint64_t aTarget, uint64_t aTag); //aTarget is the tag of the timeout
+    int  submit(uint32_t aWaitFor); //submit what is queued and wait for aWaitFor completions; -errno on failure
+    bool completion(uint64_t & aTag, int32_t & aResult); //take the next completion, false if there is none
+    int fd;
+    uint64_t wakeBuffer; //read from UIO::irqWakeFd
+    bool wakeReading;    //that read is queued or in flight
+  private:
+    void * nextSQE(uint32_t aOpcode, int aFd, uint64_t aTag);
+    void *   sqRing;
+    size_t   sqRingBytes;
+    void *   cqRing;
+    size_t   cqRingBytes;
+    void *   sqes;
+    size_t   sqesBytes;
+    uint32_t * sqHead;
+    uint32_t * sqTail;
+    uint32_t * sqArray;
+    uint32_t   sqMask;
+    uint32_t   sqEntries;
+    uint32_t   sqQueued; //queued since the last submit
+    uint32_t * cqHead;
+    uint32_t * cqTail;
+    uint32_t   cqMask;
+    void *     cqes;
+    int64_t    timeout[2]; //__kernel_timespec of the last queued timeout
+    sUIORing(sUIORing const &);
+    sUIORing & operator=(sUIORing const &);
+  };
 
   struct sUIODevice{
     sUIODevice();
-    ~sUIODevice();
+    std::shared_ptr<sUIOMapping> mapping; //owns fd and hw
     int fd;
     uint32_t volatile * hw;
     uint64_t addr;
@@ -70,7 +152,97 @@ namespace uioaxi {
     size_t   size;
     std::string uioName;
     std::string hwNodeName;
+    uint32_t burstWidth; //bits per beat for incremental block transfers (32: word by word)
+    uint32_t flags;      //eUIORegFlags that apply to every register of the endpoint
+    uint32_t mapIndex;   //maps/mapN of the uio device this is (0 for an endpoint, see fwinfo="uio_map;map=N")
+    uint32_t parentAddr; //uhal address of the endpoint a map belongs to
+    std::shared_ptr<sUIOIRQ> irq;
+  };
+
+  //What sysfs says about one /dev/uioN (collected once when a UIO client is built)
+  struct sUIOSysfsEntry{
+    uint64_t addr;     //physical address of map0
+    size_t   size;     //size of map0 in bytes
+    std::vector<uint64_t> mapAddr; //physical address of every maps/mapN (mapAddr[0] == addr)
+    std::vector<size_t>   mapSize; //size of every maps/mapN in bytes
+  };
+
+  //What the device-tree says about one labelled node under an amba bus
+  struct sUIODTEntry{
+    uint64_t addr;     //base address from the reg property
+    uint64_t size;     //size in bytes from the reg property (0 if unknown)
+  };
+
+  //One entry of the flat uHAL address -> mapped memory translation table
+  struct sUIOAddrEntry{
+    sUIOAddrEntry();
+    sUIOAddrEntry(sUIOAddrEntry const & aEntry); //(for the vector, the table is only copied while it is built)
+    uint32_t uhalAddr;
+    std::atomic<uint32_t> size; //0 while a lazy endpoint is unmapped; stored after hw, with release
+    uint32_t volatile * hw;
+    sUIODevice * dev;
+    uint32_t burstWidth;
+    uint32_t flags;
+  };
+
+  //A register access recorded in deferred mode and executed by UIO::implementDispatch
+  struct sUIOTransaction{
+    enum eType {WRITE, READ, RMW_BITS, RMW_SUM, WRITE_BLOCK, READ_BLOCK, WRITE_FIFO, READ_FIFO,
+		READ_RUN}; //READ_RUN: count neighbouring single reads served by one block read
+    eType type;
+    uint32_t addr;
+    uint32_t count;   //words for block transfers (for RMWs: 1 if the result is read back, else 0)
+    uint32_t termA;   //write value, AND term, addend or offset of the block data
+    uint32_t termB;   //OR term
+    uint32_t index;   //position of the ValWord/ValVector/ValHeader that gets the result
+    sUIOAddrEntry const * dev;
+  };
+
+  //Counters for the deferred mode dispatch optimisations
+  struct sUIODispatchStats{
+    sUIODispatchStats();
+    uint64_t coalescedRuns;  //runs of neighbouring single reads turned into one block read
+    uint64_t coalescedReads; //single reads that went into those runs
+    uint64_t squashedWrites; //writes dropped because a later write in the same run replaced them
+    uint64_t combinedRuns;   //runs of writes to neighbouring registers turned into one block write
+    uint64_t combinedWrites; //single writes that went into those runs
+  };
+
+  //Accesses one thread has pending on a client: its deferred mode queue and the ValWords, ValVectors
+  //and ValHeaders that the next dispatch() completes.  Each thread using a client gets its own
+  struct sUIOThreadState{
+    sUIOThreadState();
+    std::mutex lock; //held while the queue runs (by its thread, or by a dispatch() from any thread)
+    bool orphaned;   //its thread has exited with accesses pending, the next dispatch() drops it
+    std::vector< uhal::ValWord<uint32_t> > valwords;
+    std::vector< uhal::ValVector<uint32_t> > valvectors;
+    std::vector< uhal::ValHeader > valheaders;
+    std::vector<sUIOTransaction> transactions;
+    std::vector<uint32_t> transactionData; //block write data and block read results
+    size_t volatile transactionCurrent;    //transaction being run (for bus error reporting)
+    sUIODispatchStats dispatchStats;
+  };
+
+  //The sUIOThreadStates of a client.  Shared with the threads using the client, which remove their
+  //own when they exit (as long as the client is still there)
+  struct sUIOThreadStates{
+    std::mutex mutex;
+    std::vector< std::shared_ptr<sUIOThreadState> > states;
+    sUIODispatchStats droppedStats; //of the states of threads that have exited
   };
+
+  //Outcome of UIO::waitFor
+  struct sUIOWaitResult{
+    sUIOWaitResult();
+    bool     matched;                 //false if the timeout ran out first
+    uint32_t value;                   //last value read (unmasked)
+    uint32_t polls;                   //register reads it took
+    std::chrono::nanoseconds elapsed; //time spent waiting
+  };
+
+  //Block copies using 64 or 128 bit beats (In ProtocolUIO_burst.cpp)
+  void burstRead (uint32_t volatile const * aSrc, uint32_t * aDst, size_t aCount, uint32_t aWidth);
+  void burstWrite(uint32_t volatile * aDst, uint32_t const * aSrc, size_t aCount, uint32_t aWidth);
 }
 
 namespace uhal {
@@ -82,6 +254,8 @@ namespace uhal {
     UHAL_DEFINE_EXCEPTION_CLASS ( UnimplementedFunction , "Exception class to handle the case where an unimplemented function is called." )
     UHAL_DEFINE_EXCEPTION_CLASS ( UIOBusError , "Exception class for when an axi transaction causes a BUS_ERROR." )
     UHAL_DEFINE_EXCEPTION_CLASS ( UIODevOOR , "Exception class for when a transaction would be out of mapped range." )
+    UHAL_DEFINE_EXCEPTION_CLASS ( UIOIRQError , "Exception class for when an endpoint's interrupt can't be armed or read." )
+    UHAL_DEFINE_EXCEPTION_CLASS ( UIOIRQTimeout , "Exception class for when no interrupt arrives within the timeout." )
     UHAL_DEFINE_EXCEPTION_CLASS ( UIOMISSING , "No UIO endpoints found. Endpoints must be labeled with fwinfo=\"uio_endpoint\".  Are you using an old style address table?" )
   }
 
@@ -96,9 +270,64 @@ namespace uhal {
 	 );
     virtual ~UIO ();
 
+    //=======================================================
+    //UIO specific extensions to the uHAL client interface.
+    //These act on the hardware immediately; there is nothing to dispatch.
+    //In deferred mode anything still queued is executed first, so program order is kept.
+    //(Get to them with dynamic_cast<uhal::UIO&>(hw.getClient()))
+    //=======================================================
+
+    //Read aSize words starting at aAddr directly into aBuffer, which must hold aSize words.
+    //Unlike readBlock() there is no intermediate vector, zero fill or copy into a ValVector.
+    void readBlockInto (const uint32_t& aAddr, uint32_t * aBuffer, const uint32_t& aSize,
+			const defs::BlockReadWriteMode& aMode=defs::INCREMENTAL);
+
+    //Drain up to aSize words from the FIFO port at aAddr into aBuffer under a single fault guard.
+    //If aEmptyMask is non-zero, the status register at aEmptyAddr is read before every word and
+    //the drain stops as soon as (status & aEmptyMask) is non-zero.
+    //Returns the number of words read.
+    uint32_t readFIFO (const uint32_t& aAddr, uint32_t * aBuffer, const uint32_t& aSize,
+		       const uint32_t& aEmptyAddr = 0, const uint32_t& aEmptyMask = 0);
+
+    //Apply a list of (AND, OR) updates, in order, to the register at aAddr with a single read and
+    //a single write.  Returns the value written.
+    uint32_t rmwBits (const uint32_t& aAddr, const std::vector< std::pair<uint32_t,uint32_t> >& aTerms);
+
+    //Poll the register at aAddr until (value & aMask) == (aValue & aMask) or aTimeout ms pass (0: the
+    //client's timeout period).  It spins on the mapped register for the first waitSpin us, then either
+    //sleeps on the endpoint's interrupt (register option irq=1) or polls with a sleep that doubles up to 1 ms.
+    uioaxi::sUIOWaitResult waitFor (const uint32_t& aAddr, const uint32_t& aMask, const uint32_t& aValue,
+				    const uint32_t& aTimeout = 0);
+
+    //Interrupts of the endpoint that aAddr belongs to (In ProtocolUIO_irq.cpp).
+    //armIRQ enables the interrupt (most uio drivers disable it again each time it fires).
+    //waitIRQ blocks until it fires and returns the endpoint's interrupt count; it throws UIOIRQTimeout
+    //after aTimeout ms (0: the client's timeout period)
+    void armIRQ (const uint32_t& aAddr);
+    uint32_t waitIRQ (const uint32_t& aAddr, const uint32_t& aTimeout = 0);
+
+    //Interrupt event loop: one epoll set over the interrupts of any number of endpoints.
+    //addIRQHandler arms the interrupt of the endpoint aAddr belongs to and registers aHandler for it.
+    //serviceIRQs waits up to aTimeout ms (-1: for ever) for interrupts and, for each endpoint that fired,
+    //calls its handler with the endpoint name and interrupt count, then arms the interrupt again.
+    //It returns the number of endpoints serviced (0 on timeout or wakeIRQs from another thread).
+    //getMissedIRQs is how many interrupts of the endpoint fired without their own handler call.
+    void addIRQHandler (const uint32_t& aAddr, std::function<void(std::string const &, uint32_t)> aHandler);
+    void removeIRQHandler (const uint32_t& aAddr);
+    uint32_t serviceIRQs (const int32_t& aTimeout = -1);
+    void wakeIRQs ();
+    uint32_t getMissedIRQs (const uint32_t& aAddr);
+
+    //Counters of the deferred mode optimisations (coalesced reads, ...) since construction or the last reset,
+    //summed over all threads
+    uioaxi::sUIODispatchStats getDispatchStats() const;
+    void resetDispatchStats();
+
 
   private:
 
+    friend struct UIOBench; //bench/uio_bench.cpp times the address translation
+
     // In ProtocolUIO_reg_access
     ValHeader implementWrite (const uint32_t& aAddr, const uint32_t& aValue);
     ValWord<uint32_t> implementRead (const uint32_t& aAddr,
@@ -121,30 +350,113 @@ namespace uhal {
 				     uint8_t* aSendBufferEnd ,
 				     std::deque< std::pair< uint8_t* , uint32_t > >::iterator aReplyStartIt ,
 				     std::deque< std::pair< uint8_t* , uint32_t > >::iterator aReplyEndIt );
-    //Local store of valwords for dispatch (legacy from uHAL being IP based)
-    std::vector< ValWord<uint32_t> > valwords;
     void primeDispatch ();
 
-    //structs for handling Bus errors
+    //Pending accesses are kept per thread (valwords etc. are a legacy from uHAL being IP based).
+    //uHAL holds the client's own mutex around every implement* call and the dispatch, so a thread only
+    //races on its state with a dispatch() from another thread while running its queue from one of the
+    //UIO specific calls; sUIOThreadState::lock covers that
+    uint64_t clientId; //never reused, unlike the address of a client, so threads can cache their state by it
+    std::shared_ptr<uioaxi::sUIOThreadStates> threadStates;
+    uioaxi::sUIOThreadState & threadState(); //the calling thread's
+
+    //Address table traversal: finds the endpoints and the register options
+    void discoverEndpoints(std::string const & addressTable);
+
+    //Deferred mode (URI argument "deferred=1"): accesses are only recorded when they are queued
+    //and run in one pass, under a single fault guard, by implementDispatch
+    bool deferred;
+    bool coalesceReads; //URI argument "coalesce", on by default
+    bool combineWrites; //URI argument "combine_writes", off by default
+    bool rmwReadBack;   //URI argument "rmw_readback", on by default
+    uint32_t waitSpin;  //URI argument "wait_spin": us waitFor spins before backing off
+    uioaxi::sUIOTransaction & queueTransaction(uioaxi::sUIOThreadState & state, uioaxi::sUIOTransaction::eType aType,
+					       uioaxi::sUIOAddrEntry const & aDev, uint32_t aAddr);
+    void coalesceTransactions(uioaxi::sUIOThreadState & state);
+    void combineTransactions(uioaxi::sUIOThreadState & state);
+    void executeTransactions(); //the calling thread's queue
+    void executeTransactions(uioaxi::sUIOThreadState & state); //state.lock must be held
+    void runTransactions(uioaxi::sUIOThreadState & state);
+
+    //Handling of Bus errors (the handler itself is shared by all UIO instances)
     void SetupSignalHandler();
     void RemoveSignalHandler();
-    struct sigaction saBusError;
-    struct sigaction saBusError_old;
 
   private:
 
     //UHAL to UIO mappings
     std::map<uint32_t,uioaxi::sUIODevice> devices;
 
+    //Flat copy of devices used on every access, sorted by uhal address.
+    //The base addresses are kept in their own array so the search stays in a few cache lines
+    std::vector<uint32_t> addrTableBase;
+    std::vector<uioaxi::sUIOAddrEntry> addrTable;
+    uioaxi::sUIOAddrEntry const & lookupAddr(uint32_t aAddr, uint32_t aCount = 1);
+    //Lazy mode (URI argument "lazy"): endpoints are resolved and mapped on their first access.
+    //Until then their table entry has size 0, so they take lookupAddr's out of range branch into here
+    bool lazy;
+    std::mutex deviceMutex; //held while an endpoint is mapped on first use, or its interrupt fd is opened
+    uioaxi::sUIOAddrEntry const & lookupUnmapped(size_t aEntry, uint32_t aAddr, uint32_t aCount);
+
+    //eUIORegFlags of single registers (only those that have any)
+    std::unordered_map<uint32_t,uint32_t> registerFlags;
+    uint32_t getRegisterFlags(uioaxi::sUIOAddrEntry const & aDev, uint32_t aAddr) const;
+
     //=======================================================
     //In ProtocolUIO_io.cpp
     //=======================================================
+    //Where discovery looks, each ending in '/' (URI arguments dev_root, sysfs_root and dt_root,
+    //or UIOUHAL_DEV_ROOT, UIOUHAL_SYSFS_ROOT and UIOUHAL_DT_ROOT). Default /dev/, /sys/class/uio/, /proc/device-tree/
+    std::string devRoot;
+    std::string sysfsRoot;
+    std::string dtRoot;
+    //Discovery index, built in one pass over sysfs so that finding an endpoint is a lookup
+    std::unordered_map<std::string,uioaxi::sUIOSysfsEntry> sysfsByName; //uioN -> sysfs info
+    std::unordered_map<uint64_t,std::string> sysfsByAddr;               //map0 address -> uioN
+    std::unordered_map<std::string,std::string> uioSymlinks;            //uio_NAME -> uioN, as they are resolved
+    bool discoveryIndexBuilt;
+    void buildDiscoveryIndex();
+    //Device-tree label index for the legacy lookup, built on first use
+    std::unordered_map<std::string,uioaxi::sUIODTEntry> dtByLabel;      //label -> reg
+    bool dtIndexBuilt;
+    void buildDeviceTreeIndex();
     void openDevice  (uioaxi::sUIODevice & dev);
+    void resolveDevice(uioaxi::sUIODevice & dev);
+    void mapDevice   (uioaxi::sUIODevice & dev);
+    //Maps devs with up to mapThreads threads (URI argument "threads", 0 picks up to 4).
+    //If any fail, the first failure in the order of devs is thrown
+    uint32_t mapThreads;
+    void mapDevices  (std::vector<uioaxi::sUIODevice*> const & devs);
+    void buildAddrTable();
     int  checkDevice (uioaxi::sUIODevice & dev);    
     int  symlinkFindUIO(std::string nodeId, uint32_t nodeAddress);
     void dtFindUIO     (std::string nodeId, uint32_t nodeAddress);
-    uint64_t SearchDeviceTree(std::string const & dvtPath,
-			      std::string const & name);
+
+    //Optional on-disk copy of what discovery found (URI argument "cache" or UIOUHAL_CACHE),
+    //keyed by the address table and the device-tree, so that later clients can skip discovery
+    std::string discoveryCacheFile(std::string const & cacheDir, std::string const & addressTable);
+    bool loadDiscoveryCache(std::string const & cacheFile, std::string const & addressTable);
+    void saveDiscoveryCache(std::string const & cacheFile, std::string const & addressTable);
+
+    //=======================================================
+    //In ProtocolUIO_irq.cpp
+    //=======================================================
+    //The endpoint (not map) that aAddr belongs to, with its interrupt fd open
+    uioaxi::sUIODevice & irqDevice(uint32_t aAddr);
+    //New interrupt count of dev (updates the missed count)
+    void countIRQ(uioaxi::sUIODevice & dev, uint32_t aCount);
+    int irqEpollFd; //epoll set of the endpoints with handlers, and irqWakeFd
+    int irqWakeFd;  //eventfd for wakeIRQs
+    //io_uring backend (URI argument "irq_backend=io_uring"): the interrupt reads, their re-arms, the
+    //serviceIRQs timeout and irqWakeFd all go through irqRing, one submit per serviceIRQs call.
+    //irqUseRing is cleared, and epoll used, if the ring can't be set up
+    bool irqUseRing;
+    uioaxi::sUIORing irqRing;
+    uint64_t irqRingTimeouts; //serviceIRQs timeouts queued so far, so the ones of earlier calls can be ignored
+    void setupIRQRing();
+    void queueIRQRead(uioaxi::sUIODevice & dev, bool aArm);
+    uint32_t serviceIRQRing(int32_t aTimeout);
+    void closeIRQs();
   };
 
 }
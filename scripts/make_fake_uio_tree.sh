@@ -0,0 +1,77 @@
+#!/bin/bash
+# Build a fake UIO tree (sysfs, /dev and device-tree) with N endpoints and an address table for it,
+# so that discovery can be run and timed without hardware.
+#
+# usage: make_fake_uio_tree.sh ROOT N [EXTRA_DEV_ENTRIES]
+#
+#   ROOT/dev/uioK              regular file standing in for the device (mmap works on it)
+#   ROOT/dev/uio_EPK           -> uioK, as made by the "linux,uio-name" patch
+#   ROOT/sys/class/uio/uioK    maps/map0/{addr,size}
+#   ROOT/proc/device-tree/amba_pl/EPK@ADDR/{label,reg}
+#   ROOT/address_table.xml     TOP.EP0 ... TOP.EP(N-1), fwinfo="uio_endpoint"
+#
+# EXTRA_DEV_ENTRIES unrelated files are added to ROOT/dev to mimic a crowded /dev.
+# The environment variables to point UIOuHAL at the tree are printed at the end; with them and
+# UIOUHAL_DEBUG=1, a tool using ROOT/address_table.xml prints the time discovery took.
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 ROOT N [EXTRA_DEV_ENTRIES]" >&2
+    exit 1
+fi
+ROOT=$1
+N=$2
+EXTRA=${3:-0}
+
+MAP_SIZE=0x1000          # bytes mapped per endpoint
+BASE_ADDR=0x80000000     # AXI address of EP0
+ADDR_STRIDE=0x10000      # AXI address step between endpoints
+UHAL_STRIDE=0x1000       # uHAL (word) address step between endpoints
+
+# 32bit big-endian device-tree cell
+cell() {
+    printf "$(printf '\\x%02x\\x%02x\\x%02x\\x%02x' $((($1>>24)&255)) $((($1>>16)&255)) $((($1>>8)&255)) $(($1&255)))"
+}
+
+rm -rf "$ROOT"
+mkdir -p "$ROOT/dev" "$ROOT/sys/class/uio" "$ROOT/proc/device-tree/amba_pl"
+DT=$ROOT/proc/device-tree/amba_pl
+cell 2 > "$DT/#address-cells"
+cell 1 > "$DT/#size-cells"
+
+TABLE=$ROOT/address_table.xml
+echo '<node id="TOP">' > "$TABLE"
+
+for ((i = 0; i < N; i++)); do
+    ADDR=$((BASE_ADDR + i*ADDR_STRIDE))
+
+    SYSFS=$ROOT/sys/class/uio/uio$i
+    mkdir -p "$SYSFS/maps/map0"
+    echo "EP$i" > "$SYSFS/name"
+    printf "0x%016x\n" $ADDR > "$SYSFS/maps/map0/addr"
+    printf "0x%08x\n" $MAP_SIZE > "$SYSFS/maps/map0/size"
+
+    truncate -s $((MAP_SIZE)) "$ROOT/dev/uio$i"
+    ln -s uio$i "$ROOT/dev/uio_EP$i"
+
+    NODE=$DT/EP$i@$(printf %x $ADDR)
+    mkdir -p "$NODE"
+    printf "EP$i\0" > "$NODE/label"
+    { cell $((ADDR >> 32)); cell $((ADDR & 0xFFFFFFFF)); cell $((MAP_SIZE)); } > "$NODE/reg"
+
+    printf '  <node id="EP%d" address="0x%08x" fwinfo="uio_endpoint">\n' $i $((i*UHAL_STRIDE)) >> "$TABLE"
+    printf '    <node id="REG" address="0x0" permission="rw"/>\n' >> "$TABLE"
+    printf '  </node>\n' >> "$TABLE"
+done
+
+echo '</node>' >> "$TABLE"
+
+for ((i = 0; i < EXTRA; i++)); do
+    : > "$ROOT/dev/tty_fake$i"
+done
+
+# the environment to point UIOuHAL at this tree
+echo "export UIOUHAL_DEV_ROOT=$ROOT/dev"
+echo "export UIOUHAL_SYSFS_ROOT=$ROOT/sys/class/uio"
+echo "export UIOUHAL_DT_ROOT=$ROOT/proc/device-tree"
@@ -0,0 +1,28 @@
+#!/bin/bash
+# Run bench/uio_bench against fake UIO trees (see make_fake_uio_tree.sh), so the register access
+# paths and the discovery at startup can be timed without hardware.  Build the benchmark first with
+# "make bench".
+#
+# usage: run_bench.sh [N] [NAME=VALUE ...]
+#
+#   N            endpoints in the fake trees (default 64)
+#   NAME=VALUE   client options, as the URI arguments (e.g. lazy=1)
+#
+# Discovery is timed twice, with a bare /dev and with DEV_ENTRIES (default 5000) unrelated entries
+# added to it, to show what a crowded /dev costs at startup.
+
+set -e
+
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+N=${1:-64}
+shift || true
+DEV_ENTRIES=${DEV_ENTRIES:-5000}
+
+ROOT=$(mktemp -d)
+trap 'rm -rf "$ROOT"' EXIT
+eval "$("$DIR/scripts/make_fake_uio_tree.sh" "$ROOT/tree" "$N")"
+"$DIR/scripts/make_fake_uio_tree.sh" "$ROOT/crowded" "$N" "$DEV_ENTRIES" > /dev/null
+
+"$DIR/bin/uio_bench" "$ROOT/tree/address_table.xml" "$@"
+"$DIR/bin/uio_bench" --discovery "$ROOT/tree" "$@"
+"$DIR/bin/uio_bench" --discovery "$ROOT/crowded" "$@"
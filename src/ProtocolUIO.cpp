@@ -65,6 +65,8 @@
 #include <setjmp.h> //for BUS_ERROR signal handling
 
 #include <inttypes.h> //for PRI macros
+#include <chrono>
+#include <atomic>
 
 using namespace uioaxi;
 using namespace boost::filesystem;
@@ -74,37 +76,151 @@ UHAL_REGISTER_EXTERNAL_CLIENT(uhal::UIO, "uioaxi-1.0", "Direct access to AXI sla
 
 namespace uhal {  
 
+  //Clients built so far, for UIO::clientId
+  static std::atomic<uint64_t> clientCount(0);
+
+  //URI argument values that turn an option on ("?deferred" on its own counts as on)
+  static bool argumentIsTrue(std::string const & aValue) {
+    return (aValue.empty() ||
+	    (aValue == "1") ||
+	    (aValue == "true") ||
+	    (aValue == "yes"));
+  }
+
+  //Directory of the discovery cache for a "cache" URI argument or UIOUHAL_CACHE value ("" if off)
+  static std::string cacheDirectory(std::string const & aValue) {
+    if(argumentIsTrue(aValue)){
+      return "/run/uiouhal";
+    }
+    if((aValue == "0") || (aValue == "false") || (aValue == "no")){
+      return "";
+    }
+    return aValue;
+  }
+
+  //A discovery root as given, with the trailing '/' the paths are built with
+  static std::string rootDirectory(std::string const & aValue) {
+    return (!aValue.empty() && (aValue[aValue.size()-1] == '/')) ? aValue : aValue + "/";
+  }
+
+  //What the fwinfo of a node asks for (e.g. fwinfo="uio_endpoint;burst=64", fwinfo="uio_map;map=1" or
+  //fwinfo="uio_register;side_effect=1;rmw_readback=0;irq=1"), read in one pass over its fields
+  struct sFirmwareInfo {
+    bool endpoint;
+    bool map;
+    uint32_t mapIndex;
+    uint32_t flags;            //eUIORegFlags
+    uint32_t flagsGiven;       //the eUIORegFlags the fwinfo sets either way (a map inherits the others)
+    std::string const * burst; //NULL if not given
+  };
+
+  template<typename T>
+  static sFirmwareInfo parseFirmwareInfo(T const & aFirmwareInfo) {
+    sFirmwareInfo info = {false, false, 0, 0, 0, NULL};
+    for(auto itField = aFirmwareInfo.begin(); itField != aFirmwareInfo.end(); itField++){
+      if(itField->first == "type"){
+	info.endpoint = (itField->second == "uio_endpoint");
+	info.map = (itField->second == "uio_map");
+      }else if(itField->first == "map"){
+	info.mapIndex = std::strtoul(itField->second.c_str(),NULL,0);
+      }else if(itField->first == "side_effect"){
+	info.flags |= argumentIsTrue(itField->second) ? uioaxi::REG_SIDE_EFFECT : 0;
+	info.flagsGiven |= uioaxi::REG_SIDE_EFFECT;
+      }else if(itField->first == "rmw_readback"){
+	info.flags |= argumentIsTrue(itField->second) ? 0 : uioaxi::REG_NO_READBACK;
+	info.flagsGiven |= uioaxi::REG_NO_READBACK;
+      }else if(itField->first == "irq"){
+	info.flags |= argumentIsTrue(itField->second) ? uioaxi::REG_IRQ : 0;
+	info.flagsGiven |= uioaxi::REG_IRQ;
+      }else if(itField->first == "burst"){
+	info.burst = &(itField->second);
+      }
+    }
+    return info;
+  }
 
   UIO::UIO (
 	    const std::string& aId, const URI& aUri,
 	    const boost::posix_time::time_duration&aTimeoutPeriod
 	    ) :
-    ClientInterface(aId,aUri,aTimeoutPeriod)
+    ClientInterface(aId,aUri,aTimeoutPeriod),
+    clientId(++clientCount),
+    threadStates(std::make_shared<sUIOThreadStates>()),
+    deferred(false),
+    coalesceReads(true),
+    combineWrites(false),
+    rmwReadBack(true),
+    waitSpin(50),
+    lazy(false),
+    devRoot("/dev/"),
+    sysfsRoot("/sys/class/uio/"),
+    dtRoot("/proc/device-tree/"),
+    discoveryIndexBuilt(false),
+    dtIndexBuilt(false),
+    mapThreads(0),
+    irqEpollFd(-1),
+    irqWakeFd(-1),
+    irqUseRing(false),
+    irqRingTimeouts(0)
   {
-    //Search through the device tree for fw_info tags
-    NodeTreeBuilder & mynodetreebuilder = NodeTreeBuilder::getInstance();
-    Node* lNode = ( mynodetreebuilder.getNodeTree ( std::string("file://")+aUri.mHostname , boost::filesystem::current_path() / "." ) );
+    //Discovery cache directory from UIOUHAL_CACHE, the "cache" URI argument overrides it
+    std::string cacheDir = (NULL != getenv("UIOUHAL_CACHE")) ? cacheDirectory(getenv("UIOUHAL_CACHE")) : "";
 
-    //Search through the address table for nodes with endpoint fw_info tags
-    auto itNode = lNode->begin();
-    for(++itNode ; itNode != lNode->end();itNode++){
-      //fprintf(stderr,"Processing Node: %s (%zd)\n",itNode->getId().c_str(),itNode->getFirmwareInfo().size());
-      //This search goes through all nodes and visits many that aren't needed, but the API doesn't let
-      //us easily simplify this.  It only has to be done once, so it isn't the endof the world
-      if( itNode->getFirmwareInfo().size() &&
-	  itNode->getFirmwareInfo().find("type") != itNode->getFirmwareInfo().end() &&
-	  itNode->getFirmwareInfo().find("type")->second == std::string("uio_endpoint")
-	  ){
-	
-	std::string name = itNode->getPath().substr(4);
-	//This is an endpoint
-	//add it to the lookup table
-	// try the simple method using "linux,uio-name" patch, else use the complex method (iterating thru dirs)
-	if (!symlinkFindUIO(name,itNode->getAddress())) {
-	  dtFindUIO(name,itNode->getAddress());
+    //Discovery roots from the environment (for testing against a fake tree), the URI arguments override them
+    if(NULL != getenv("UIOUHAL_DEV_ROOT")){
+      devRoot = rootDirectory(getenv("UIOUHAL_DEV_ROOT"));
+    }
+    if(NULL != getenv("UIOUHAL_SYSFS_ROOT")){
+      sysfsRoot = rootDirectory(getenv("UIOUHAL_SYSFS_ROOT"));
+    }
+    if(NULL != getenv("UIOUHAL_DT_ROOT")){
+      dtRoot = rootDirectory(getenv("UIOUHAL_DT_ROOT"));
+    }
+
+    //Client options from the URI arguments
+    for(auto itArg = aUri.mArguments.begin(); itArg != aUri.mArguments.end(); itArg++){
+      if(itArg->first == "deferred"){
+	deferred = argumentIsTrue(itArg->second);
+      }else if(itArg->first == "coalesce"){
+	coalesceReads = argumentIsTrue(itArg->second);
+      }else if(itArg->first == "combine_writes"){
+	combineWrites = argumentIsTrue(itArg->second);
+      }else if(itArg->first == "rmw_readback"){
+	rmwReadBack = argumentIsTrue(itArg->second);
+      }else if(itArg->first == "wait_spin"){
+	waitSpin = std::strtoul(itArg->second.c_str(),NULL,0);
+      }else if(itArg->first == "threads"){
+	mapThreads = std::strtoul(itArg->second.c_str(),NULL,0);
+      }else if(itArg->first == "lazy"){
+	lazy = argumentIsTrue(itArg->second);
+      }else if(itArg->first == "dev_root"){
+	devRoot = rootDirectory(itArg->second);
+      }else if(itArg->first == "sysfs_root"){
+	sysfsRoot = rootDirectory(itArg->second);
+      }else if(itArg->first == "dt_root"){
+	dtRoot = rootDirectory(itArg->second);
+      }else if(itArg->first == "cache"){
+	cacheDir = cacheDirectory(itArg->second);
+      }else if(itArg->first == "irq_backend"){
+	if((itArg->second != "io_uring") && (itArg->second != "epoll")){
+	  log(Warning(), "Unknown irq_backend ", itArg->second, ", using epoll");
 	}
+	irqUseRing = (itArg->second == "io_uring");
+      }else{
+	log(Warning(), "Ignoring unknown URI argument ", itArg->first);
       }
     }
+
+    //Find the endpoints, from the discovery cache if there is a valid one
+    std::chrono::steady_clock::time_point discoveryStart = std::chrono::steady_clock::now();
+    std::string cacheFile;
+    if(!cacheDir.empty()){
+      cacheFile = discoveryCacheFile(cacheDir, aUri.mHostname);
+    }
+    bool cacheHit = !cacheFile.empty() && loadDiscoveryCache(cacheFile, aUri.mHostname);
+    if(!cacheHit){
+      discoverEndpoints(aUri.mHostname);
+    }
   
     if(devices.size() == 0){
       uhal::exception::UIOMISSING * e = new uhal::exception::UIOMISSING();
@@ -112,13 +228,131 @@ namespace uhal {
       throw e;
     }
 
+    if (NULL != getenv("UIOUHAL_DEBUG")) {
+      printf("Found %zu UIO endpoints%s in %" PRId64 " us\n", devices.size(), cacheHit ? " (from cache)" : "",
+	     (int64_t) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - discoveryStart).count());
+    }
+
+    //(a lazy client hasn't resolved its endpoints, so it has nothing to cache)
+    if(!cacheFile.empty() && !cacheHit && !lazy){
+      saveDiscoveryCache(cacheFile, aUri.mHostname);
+    }
+
+    //Build the flat lookup table used by every register access
+    buildAddrTable();
+
     //Now that everything created sucessfully, we can deal with signal handling
     SetupSignalHandler();
   }
 
+  void UIO::discoverEndpoints(std::string const & addressTable) {
+    bool debug = (NULL != getenv("UIOUHAL_DEBUG"));
+
+    //Collect what sysfs and /dev know about uio devices once, rather than once per endpoint
+    //(a lazy client does this on its first access)
+    if(!lazy){
+      buildDiscoveryIndex();
+    }
+
+    //Search through the device tree for fw_info tags
+    std::chrono::steady_clock::time_point parseStart = std::chrono::steady_clock::now();
+    NodeTreeBuilder & mynodetreebuilder = NodeTreeBuilder::getInstance();
+    Node* lNode = ( mynodetreebuilder.getNodeTree ( std::string("file://")+addressTable , boost::filesystem::current_path() / "." ) );
+
+    //Search through the address table for nodes with endpoint fw_info tags
+    //Finding an endpoint is only index lookups, the open+mmap of each is done afterwards in parallel
+    std::chrono::steady_clock::time_point traversalStart = std::chrono::steady_clock::now();
+    std::vector<sUIODevice*> toMap;
+    std::string endpointPath; //of the last endpoint, for the uio_map nodes inside it
+    uint32_t endpointAddr = 0;
+    size_t nodeCount = 0;
+    auto itNode = lNode->begin();
+    for(++itNode ; itNode != lNode->end();itNode++){
+      //Every node is visited: the iterator can't skip a subtree, and the registers inside an endpoint
+      //can carry options of their own.  Most nodes have no fwinfo and cost a mode check.
+      nodeCount++;
+      sFirmwareInfo info = {false, false, 0, 0, 0, NULL};
+      if(!itNode->getFirmwareInfo().empty()){
+	info = parseFirmwareInfo(itNode->getFirmwareInfo());
+      }
+
+      //FIFO ports and registers marked side_effect=1 must keep every write, in order.
+      //rmw_readback=0 drops the verification read at the end of an RMW.
+      if(defs::NON_INCREMENTAL == itNode->getMode()){
+	info.flags |= REG_SIDE_EFFECT;
+	info.flagsGiven |= REG_SIDE_EFFECT;
+      }
+
+      if(info.map && (0 == info.mapIndex)){
+	log(Warning(), "Ignoring ", itNode->getPath(), ", map 0 is the endpoint itself");
+	info.map = false;
+      }else if(info.map &&
+	       (endpointPath.empty() || (itNode->getPath().compare(0, endpointPath.size()+1, endpointPath + ".") != 0))){
+	log(Warning(), "Ignoring ", itNode->getPath(), ", a uio_map must be inside a uio_endpoint");
+	info.map = false;
+      }
+
+      if(info.endpoint || info.map){
+	std::string name = itNode->getPath().substr(4);
+	sUIODevice & dev = devices[itNode->getAddress()];
+	dev.uhalAddr = itNode->getAddress();
+	dev.hwNodeName = name;
+	if(info.endpoint){
+	  endpointPath = itNode->getPath();
+	  endpointAddr = itNode->getAddress();
+	}else{
+	  //another map of the endpoint's uio device, e.g. a BRAM or DMA window, with the endpoint's options
+	  sUIODevice const & parent = devices[endpointAddr];
+	  dev.mapIndex = info.mapIndex;
+	  dev.parentAddr = endpointAddr;
+	  dev.burstWidth = parent.burstWidth;
+	  info.flags |= parent.flags & ~info.flagsGiven; //(its own side_effect=0 etc. win)
+	}
+
+	//Optional wide beats for incremental block transfers, e.g. fwinfo="uio_endpoint;burst=64"
+	if(NULL != info.burst){
+	  uint32_t burstWidth = std::strtoul(info.burst->c_str(),NULL,0);
+	  if((64 == burstWidth) || (128 == burstWidth)){
+	    dev.burstWidth = burstWidth;
+	  }else{
+	    log(Warning(), "Ignoring burst width ", *info.burst, " for ", name, " (only 64 and 128 are supported)");
+	  }
+	}
+
+	//On an endpoint these apply to all of its registers
+	dev.flags = info.flags;
+
+	//This is an endpoint (or map), add it to the lookup table.
+	//A lazy client only remembers it, lookupUnmapped resolves it when it is first used
+	if(!lazy){
+	  resolveDevice(dev);
+	  toMap.push_back(&dev);
+	}
+      }else if(info.flags){
+	uint32_t count = (defs::INCREMENTAL == itNode->getMode()) ? itNode->getSize() : 1;
+	for(uint32_t iReg = 0; iReg < count; iReg++){
+	  registerFlags[itNode->getAddress() + iReg] |= info.flags;
+	}
+      }
+    }
+
+    std::chrono::steady_clock::time_point mapStart = std::chrono::steady_clock::now();
+    mapDevices(toMap);
+
+    if(debug){
+      printf("Parsed address table in %" PRId64 " us, traversed %zu nodes in %" PRId64 " us, mapped %zu endpoints in %" PRId64 " us\n",
+	     (int64_t) std::chrono::duration_cast<std::chrono::microseconds>(traversalStart - parseStart).count(),
+	     nodeCount,
+	     (int64_t) std::chrono::duration_cast<std::chrono::microseconds>(mapStart - traversalStart).count(),
+	     toMap.size(),
+	     (int64_t) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - mapStart).count());
+    }
+  }
+
   UIO::~UIO () {
     log ( Debug() , "UIO: destructor" );
     RemoveSignalHandler();
+    closeIRQs();
 
   }
 
@@ -0,0 +1,165 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include <ProtocolUIO.hpp>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//Block copies between mapped AXI memory and local buffers using 64 or 128 bit beats.
+//On slaves that support it (BRAM, DDR windows) wide loads and stores turn into AXI bursts.
+//The mapped side is always accessed with naturally aligned beats: single words are used
+//until the mapped pointer is aligned and for whatever is left over at the end.
+//The local buffer has no alignment requirement, so it is accessed with memcpy.
+
+namespace uioaxi {
+
+  namespace {
+
+    //One 64 bit beat
+    inline void readBeat64(uint32_t volatile const * aSrc, uint32_t * aDst){
+      uint64_t beat = *((uint64_t volatile const *) aSrc);
+      memcpy(aDst,&beat,sizeof(beat));
+    }
+    inline void writeBeat64(uint32_t volatile * aDst, uint32_t const * aSrc){
+      uint64_t beat;
+      memcpy(&beat,aSrc,sizeof(beat));
+      *((uint64_t volatile *) aDst) = beat;
+    }
+
+    //One 128 bit beat
+    //The asm statements make sure the compiler emits exactly one 128 bit access per beat
+    //and doesn't split, merge or reorder them.
+#if defined(__aarch64__)
+    inline void readBeat128(uint32_t volatile const * aSrc, uint32_t * aDst){
+      uint64_t lo,hi;
+      __asm__ volatile("ldp %0, %1, [%2]" : "=r"(lo), "=r"(hi) : "r"(aSrc) : "memory");
+      memcpy(aDst  ,&lo,sizeof(lo));
+      memcpy(aDst+2,&hi,sizeof(hi));
+    }
+    inline void writeBeat128(uint32_t volatile * aDst, uint32_t const * aSrc){
+      uint64_t lo,hi;
+      memcpy(&lo,aSrc  ,sizeof(lo));
+      memcpy(&hi,aSrc+2,sizeof(hi));
+      __asm__ volatile("stp %0, %1, [%2]" : : "r"(lo), "r"(hi), "r"(aDst) : "memory");
+    }
+#elif defined(__SSE2__)
+    inline void readBeat128(uint32_t volatile const * aSrc, uint32_t * aDst){
+      __m128i beat = _mm_load_si128((__m128i const *) aSrc);
+      __asm__ volatile("" : : : "memory");
+      _mm_storeu_si128((__m128i *) aDst,beat);
+    }
+    inline void writeBeat128(uint32_t volatile * aDst, uint32_t const * aSrc){
+      __m128i beat = _mm_loadu_si128((__m128i const *) aSrc);
+      _mm_store_si128((__m128i *) aDst,beat);
+      __asm__ volatile("" : : : "memory");
+    }
+#else
+    //No 128 bit access available, use two 64 bit beats
+    inline void readBeat128(uint32_t volatile const * aSrc, uint32_t * aDst){
+      readBeat64(aSrc  ,aDst  );
+      readBeat64(aSrc+2,aDst+2);
+    }
+    inline void writeBeat128(uint32_t volatile * aDst, uint32_t const * aSrc){
+      writeBeat64(aDst  ,aSrc  );
+      writeBeat64(aDst+2,aSrc+2);
+    }
+#endif
+
+    template<size_t WORDS, void (*BEAT)(uint32_t volatile const *, uint32_t *)>
+    void burstReadBeats(uint32_t volatile const * aSrc, uint32_t * aDst, size_t aCount){
+      //head: single words until the mapped pointer is aligned to a beat
+      while (aCount && (uintptr_t(aSrc) % (WORDS*sizeof(uint32_t)))) {
+	*aDst++ = *aSrc++;
+	aCount--;
+      }
+      for (; aCount >= WORDS; aCount -= WORDS, aSrc += WORDS, aDst += WORDS) {
+	BEAT(aSrc,aDst);
+      }
+      //tail
+      while (aCount--) {
+	*aDst++ = *aSrc++;
+      }
+    }
+
+    template<size_t WORDS, void (*BEAT)(uint32_t volatile *, uint32_t const *)>
+    void burstWriteBeats(uint32_t volatile * aDst, uint32_t const * aSrc, size_t aCount){
+      //head: single words until the mapped pointer is aligned to a beat
+      while (aCount && (uintptr_t(aDst) % (WORDS*sizeof(uint32_t)))) {
+	*aDst++ = *aSrc++;
+	aCount--;
+      }
+      for (; aCount >= WORDS; aCount -= WORDS, aSrc += WORDS, aDst += WORDS) {
+	BEAT(aDst,aSrc);
+      }
+      //tail
+      while (aCount--) {
+	*aDst++ = *aSrc++;
+      }
+    }
+  }
+
+  void burstRead(uint32_t volatile const * aSrc, uint32_t * aDst, size_t aCount, uint32_t aWidth){
+    if (128 == aWidth) {
+      burstReadBeats<4,readBeat128>(aSrc,aDst,aCount);
+    } else {
+      burstReadBeats<2,readBeat64>(aSrc,aDst,aCount);
+    }
+  }
+
+  void burstWrite(uint32_t volatile * aDst, uint32_t const * aSrc, size_t aCount, uint32_t aWidth){
+    if (128 == aWidth) {
+      burstWriteBeats<4,writeBeat128>(aDst,aSrc,aCount);
+    } else {
+      burstWriteBeats<2,writeBeat64>(aDst,aSrc,aCount);
+    }
+  }
+
+}//uioaxi namespace
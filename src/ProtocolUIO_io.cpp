@@ -49,6 +49,9 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
 #include <boost/filesystem.hpp>
 #include <boost/shared_ptr.hpp>
 #include <uhal/Node.hpp>
@@ -65,6 +68,13 @@
 #include <setjmp.h> //for BUS_ERROR signal handling
 
 #include <inttypes.h> //for PRI macros
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <system_error>
+#include <mutex>
+#include <limits.h> //for PATH_MAX
 
 
 namespace uioaxi {
@@ -72,18 +82,47 @@ namespace uioaxi {
   sUIODevice::sUIODevice() : 
     fd(-1),
     hw(NULL),
-    size(0){
+    size(0),
+    burstWidth(32),
+    flags(0),
+    mapIndex(0),
+    parentAddr(0){
   }
   
-  sUIODevice::~sUIODevice()
+  sUIOAddrEntry::sUIOAddrEntry() :
+    uhalAddr(0),
+    size(0),
+    hw(NULL),
+    dev(NULL),
+    burstWidth(32),
+    flags(0){
+  }
+
+  sUIOAddrEntry::sUIOAddrEntry(sUIOAddrEntry const & aEntry) :
+    uhalAddr(aEntry.uhalAddr),
+    size(aEntry.size.load(std::memory_order_relaxed)),
+    hw(aEntry.hw),
+    dev(aEntry.dev),
+    burstWidth(aEntry.burstWidth),
+    flags(aEntry.flags){
+  }
+
+  sUIOMapping::sUIOMapping() :
+    fd(-1),
+    hw(NULL),
+    bytes(0),
+    mapIndex(0){
+  }
+
+  sUIOMapping::~sUIOMapping()
   {
     if(NULL != hw) {
-      munmap((void *)(hw),size);
+      munmap((void *)(hw),bytes);
     }
     if(fd != -1){
       close(fd);
     }
-  }  
+  }
 }//uioaxi namespace
 
 
@@ -94,46 +133,162 @@ using namespace boost::filesystem;
 
 namespace uhal {  
 
-  uint64_t UIO::SearchDeviceTree(std::string const & dvtPath,
-				 std::string const & name) {
-    uint64_t address = 0;
-    FILE *labelfile=0; 
-    char label[128];
-    // traverse through the device-tree    
-    for (directory_iterator x(dvtPath); x!=directory_iterator(); ++x) {
-      if (!is_directory(x->path()) || !exists(x->path()/"label")) {
-	      continue;
+  //Read a whole (small) device-tree property file
+  static bool readDTProperty(std::string const & path, std::vector<uint8_t> & data) {
+    data.clear();
+    FILE *propfile = fopen(path.c_str(), "r");
+    if (propfile == NULL) {
+      return false;
+    }
+    uint8_t buffer[256];
+    size_t readSize;
+    while ((readSize = fread(buffer, 1, sizeof(buffer), propfile)) > 0) {
+      data.insert(data.end(), buffer, buffer + readSize);
+    }
+    fclose(propfile);
+    return true;
+  }
+
+  //Device-tree cells are big-endian 32bit words, a value spans one or more of them
+  static uint64_t readDTCells(std::vector<uint8_t> const & data, size_t cellOffset, uint32_t cellCount) {
+    uint64_t value = 0;
+    for (size_t iByte = cellOffset*4; iByte < (cellOffset + cellCount)*4; iByte++) {
+      value = (value << 8) | data[iByte];
+    }
+    return value;
+  }
+
+  //#address-cells / #size-cells of a bus node (the device-tree defaults if missing)
+  static uint32_t readDTCellCount(std::string const & path, uint32_t defaultCount) {
+    std::vector<uint8_t> data;
+    if (!readDTProperty(path, data) || data.size() != 4) {
+      return defaultCount;
+    }
+    return readDTCells(data, 0, 1);
+  }
+
+  void UIO::buildDeviceTreeIndex() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    dtByLabel.clear();
+    dtIndexBuilt = true;
+
+    // one pass over the children of every amba, amba_pl, ... bus node
+    std::string dvtpath = dtRoot;
+    if (!is_directory(dvtpath)) {
+      return;
+    }
+    std::vector<uint8_t> data;
+    for (directory_iterator itDVTPath(dvtpath); itDVTPath!=directory_iterator(); ++itDVTPath) {
+      //Check that this is a path with amba in its name
+      if ((!is_directory(itDVTPath->path())) || (itDVTPath->path().filename().native().find("amba")==std::string::npos)) {
+        continue;
       }
-      labelfile = fopen((x->path().native()+"/label").c_str(),"r");
-      fgets(label,128,labelfile); 
-      fclose(labelfile);
-
-      if(!strcmp(label, name.c_str())) {
-	      //Get endpoint AXI address from path
-	      // looks something like LABEL@DEADBEEFXX
-	      std::string stringAddr=x->path().filename().native();        
-
-	      //Check if we find the @
-	      size_t addrStart = stringAddr.find("@");
-	      if (addrStart == std::string::npos) {
-	        log ( Debug() , "directory name ", x->path().filename().native().c_str() ," has incorrect format. Missing \"@\" " );
-	        break; //expect the name to be in x@xxxxxxxx format for example myReg@0x41200000
+      uint32_t addressCells = readDTCellCount((itDVTPath->path()/"#address-cells").native(), 2);
+      uint32_t sizeCells    = readDTCellCount((itDVTPath->path()/"#size-cells").native(), 1);
+
+      for (directory_iterator x(itDVTPath->path()); x!=directory_iterator(); ++x) {
+        if (!is_directory(x->path()) || !readDTProperty((x->path()/"label").native(), data)) {
+          continue;
+        }
+        //the label is a NUL terminated string
+        std::string label(data.begin(), std::find(data.begin(), data.end(), '\0'));
+        if (dtByLabel.find(label) != dtByLabel.end()) {
+          continue; //first match wins, as with the old search
         }
 
-        //Convert the found string into binary
-        if (addrStart+1 > stringAddr.size()) {
-          log ( Debug() , "directory name ", x->path().filename().native().c_str() ," has incorrect format. Missing size " );
-          break; //expect the name to be in x@xxxxxxxx format for example myReg@0x41200000
+        sUIODTEntry entry;
+        entry.addr = 0;
+        entry.size = 0;
+        if (readDTProperty((x->path()/"reg").native(), data) &&
+            (addressCells + sizeCells) > 0 && (addressCells + sizeCells) <= 4 &&
+            data.size() >= (addressCells + sizeCells)*4) {
+          //first (address,size) pair of the reg property
+          entry.addr = readDTCells(data, 0, addressCells);
+          entry.size = readDTCells(data, addressCells, sizeCells);
+        } else {
+          //no usable reg property, fall back to the LABEL@DEADBEEFXX directory name
+          std::string stringAddr = x->path().filename().native();
+          size_t addrStart = stringAddr.find("@");
+          if (addrStart == std::string::npos || addrStart+1 >= stringAddr.size()) {
+            log ( Debug() , "directory name ", stringAddr.c_str() ," has incorrect format and no reg property" );
+            continue;
+          }
+          entry.addr = std::strtoull(stringAddr.substr(addrStart+1).c_str() , 0, 16);
         }
+        dtByLabel[label] = entry;
+      }
+    }
 
-	      stringAddr = stringAddr.substr(addrStart+1);
+    if (NULL != getenv("UIOUHAL_DEBUG")) {
+      printf("Built device-tree label index (%zu labels) in %" PRId64 " us\n",
+	     dtByLabel.size(),
+	     (int64_t) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+  }
+
+  //Read a single hex value (e.g. maps/map0/addr) from sysfs
+  static bool readSysfsValue(std::string const & path, uint64_t & value) {
+    char valuechar[128]="";
+    FILE *valuefile = fopen(path.c_str(), "r");
+    if (valuefile == NULL) {
+      return false;
+    }
+    bool ok = (NULL != fgets(valuechar, 128, valuefile));
+    fclose(valuefile);
+    value = std::strtoull(valuechar, 0, 16);
+    return ok;
+  }
 
-        //Get the names's address from the path (in hex)
-        address = std::strtoull(stringAddr.c_str() , 0, 16);
-        break;
+  //The uioN that /dev/uio_NAME links to, straight from the link (no scan of /dev)
+  static bool readUIOSymlink(std::string const & linkPath, std::string & deviceFile) {
+    char target[PATH_MAX];
+    ssize_t targetSize = readlink(linkPath.c_str(), target, sizeof(target)-1);
+    if (targetSize <= 0) {
+      return false; //missing, or not a symlink
+    }
+    target[targetSize] = '\0';
+    deviceFile = path(target).filename().native();
+    return true;
+  }
+
+  void UIO::buildDiscoveryIndex() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    sysfsByName.clear();
+    sysfsByAddr.clear();
+    uioSymlinks.clear();
+    discoveryIndexBuilt = true;
+    dtIndexBuilt = false;
+
+    // one pass over /sys/class/uio: address and size of every map of every uio device
+    std::string uiopath = sysfsRoot;
+    if (is_directory(uiopath)) {
+      for (directory_iterator x(uiopath); x!=directory_iterator(); ++x) {
+	sUIOSysfsEntry entry;
+	uint64_t mapSize = 0;
+	if (!readSysfsValue((x->path()/"maps/map0/addr").native(), entry.addr) ||
+	    !readSysfsValue((x->path()/"maps/map0/size").native(), mapSize)) {
+	  continue;
+	}
+	entry.size = mapSize;
+	entry.mapAddr.push_back(entry.addr);
+	entry.mapSize.push_back(entry.size);
+	for (uint64_t extraAddr = 0;
+	     readSysfsValue((x->path()/"maps"/("map" + std::to_string(entry.mapAddr.size()))/"addr").native(), extraAddr) &&
+	       readSysfsValue((x->path()/"maps"/("map" + std::to_string(entry.mapAddr.size()))/"size").native(), mapSize);) {
+	  entry.mapAddr.push_back(extraAddr);
+	  entry.mapSize.push_back(mapSize);
+	}
+	std::string uioName = x->path().filename().native();
+	sysfsByName[uioName] = entry;
+	sysfsByAddr[entry.addr] = uioName;
       }
     }
-    return address;
+
+    if (NULL != getenv("UIOUHAL_DEBUG")) {
+      printf("Built UIO discovery index (%zu uio devices) in %" PRId64 " us\n",
+	     sysfsByName.size(),
+	     (int64_t) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    }
   }
 
   int UIO::symlinkFindUIO(std::string nodeId, uint32_t nodeAddress) {
@@ -141,68 +296,36 @@ namespace uhal {
     char* UIOUHAL_DEBUG = getenv("UIOUHAL_DEBUG");
     int size = 0;
     std::string uioName = "";
-    char sizechar[128]="", addrchar[128]="";
     uint64_t address = 0;
     // uio name set by the "linux,uio-name" device-tree property -> ex: "uio_K_C2C_PHY"
-    std::string prefix = "/dev/";
+    std::string prefix = devRoot;
     uioName = std::string(uio_prefix) + nodeId;
     // first check if /dev/uio_name exists and if so get the uio device file it points to: /dev/uio_NAME -> /dev/uioN
     std::string deviceFile;
     if (NULL != UIOUHAL_DEBUG) {
       printf("searching for /dev/%s symlink\n", uioName.c_str());
     }
-    for (directory_iterator itUIO(prefix); itUIO != directory_iterator(); ++itUIO) {
-      if ((is_directory(itUIO->path())) || (itUIO->path().string().find(uioName) == std::string::npos)) {
-        continue;
-      }
-      else {
-        // found /dev/uio_name, now resolve symlink
-        if (is_symlink(itUIO->path())) {
-          deviceFile = read_symlink(itUIO->path()).string();
-        }
-        else {
-          if (NULL != UIOUHAL_DEBUG) {
-            printf("unable to resolve symlink /dev/%s -> /dev/uioN, using legacy method", uioName.c_str());
-          }
-          log (Debug(), "Symlink ", prefix, uioName, " could not be resolved.");
-          return 0;
-        }
-      }
-    }
-    // at this point we can simply grab the proper uio from /sys/class/uio/uioN
-    FILE *addrfile=0;
-    FILE *sizefile=0;
-    std::string uiopath = "/sys/class/uio/";
-
-    addrfile = fopen((uiopath + deviceFile + "/maps/map0/addr").c_str(), "r");
-    if (addrfile != NULL) {
-      fgets(addrchar, 128, addrfile);
-      fclose(addrfile);
-    }
-    else {
-      // try longer method
+    if (!readUIOSymlink(prefix + uioName, deviceFile)) {
       if (NULL != UIOUHAL_DEBUG) {
-        printf("Simple UIO finding method could not find address file at %s, using legacy method\n", (uiopath+deviceFile+"/maps/map0/addr").c_str());
+        printf("unable to resolve symlink /dev/%s -> /dev/uioN, using legacy method\n", uioName.c_str());
       }
-      log(Debug(), "Simple UIO finding method could not find address file at ", (uiopath + deviceFile + "/maps/map0/addr").c_str());
+      log (Debug(), "Symlink ", prefix, uioName, " could not be resolved.");
       return 0;
     }
-    // get address
-    address = std::strtoull(addrchar, 0, 16);
-    sizefile = fopen((uiopath + deviceFile + "/maps/map0/size").c_str(), "r");
-    if (sizefile != NULL) {
-      fgets(sizechar, 128, sizefile);
-      fclose(sizefile);
-    }
-    else {
+    uioSymlinks[uioName] = deviceFile;
+
+    // at this point we can simply grab the proper uio from the sysfs index
+    std::unordered_map<std::string,sUIOSysfsEntry>::const_iterator itSysfs = sysfsByName.find(deviceFile);
+    if (itSysfs == sysfsByName.end()) {
       // try longer method
       if (NULL != UIOUHAL_DEBUG) {
-        printf("Simple UIO finding method could not find size file at %s, using legacy method\n", (uiopath + deviceFile + "/maps/map0/size").c_str());
+        printf("Simple UIO finding method could not find map0 of %s in sysfs, using legacy method\n", deviceFile.c_str());
       }
-      log(Debug(), "Simple UIO finding method could not find size file at ", (uiopath + deviceFile + "/maps/map0/size").c_str());
+      log(Debug(), "Simple UIO finding method could not find map0 of ", deviceFile.c_str(), " in sysfs");
       return 0;
     }
-    size = std::strtoul(sizechar, 0, 16)/4;
+    address = itSysfs->second.addr;
+    size = itSysfs->second.size/4;
 
     // check size
     if (!size) {
@@ -219,25 +342,7 @@ namespace uhal {
     devices[nodeAddress].uioName = uioName;
     devices[nodeAddress].hwNodeName = nodeId;
     devices[nodeAddress].size = size;
-
-    // map the memory
-    openDevice(devices[nodeAddress]);
-    
-
-    if (NULL != getenv("UIOUHAL_DEBUG")) {
-      printf("Added:\n");
-      printf("  uhal addr: 0x%08X\n",devices[nodeAddress].uhalAddr);
-      printf("  addr:      0x%016" PRIX64 "\n",devices[nodeAddress].addr);
-      printf("  uio name:  \"%s\"\n",devices[nodeAddress].uioName.c_str());
-      printf("  hw  name:  \"%s\"\n",devices[nodeAddress].hwNodeName.c_str());
-      printf("  size:      0x%08X\n",devices[nodeAddress].size);
-      printf("  map:       %p\n"    ,devices[nodeAddress].hw);
-    }
-
-    //Check that the device (will throw if it is bad)
-    checkDevice(devices[nodeAddress]);
-
-    
+    //(mapped later by mapDevice)
     return 1;
   }
 
@@ -248,54 +353,26 @@ namespace uhal {
     // copied from Siqi's original code
     int size = 0;
     std::string uioName;
-    char sizechar[128]="", addrchar[128]="";
-    uint64_t address1 = 0, address2 = 0;
-
-    // iterate thru filesys to get the matching uio device 
-    std::string uiopath = "/sys/class/uio/";
-    std::string dvtpath = "/proc/device-tree/";
-    FILE *addrfile=0;
-    FILE *sizefile=0;
-    // loop over all amba, amba_pl paths
-    for (directory_iterator itDVTPath(dvtpath); itDVTPath!=directory_iterator(); ++itDVTPath) {
-      //Check that this is a path with amba in its name
-      if ((!is_directory(itDVTPath->path())) || (itDVTPath->path().string().find("amba")==std::string::npos)) {
-        continue;
-      }
-      else {
-        address1=SearchDeviceTree(itDVTPath->path().string(),(nodeId));
-        if (address1 != 0) {
-          //we found the correct entry
-          break;
-        }
-      }
+    uint64_t address1 = 0;
+
+    // the device-tree is only walked (once) if some endpoint needs it
+    if (!dtIndexBuilt) {
+      buildDeviceTreeIndex();
+    }
+    std::unordered_map<std::string,sUIODTEntry>::const_iterator itLabel = dtByLabel.find(nodeId);
+    if (itLabel != dtByLabel.end()) {
+      address1 = itLabel->second.addr;
     }
     //check if we found anything
     if(address1==0) log (Debug(), "Cannot find a device that matches label ", (nodeId).c_str(), " device not opened!" );
-    // Traverse through the /sys/class/uio directory
-    for (directory_iterator x(uiopath); x!=directory_iterator(); ++x) {
-      if (!is_directory(x->path())) {
-        continue;
-      }
-      if (!exists(x->path()/"maps/map0/addr")) {
-        continue;
-      }
-      if (!exists(x->path()/"maps/map0/size")) {
-        continue;
-      }
-      addrfile = fopen((x->path()/"maps/map0/addr").native().c_str(),"r");
-      fgets(addrchar,128,addrfile); 
-      fclose(addrfile);
-
-      address2 = std::strtoull( addrchar, 0, 16);
-      if (address1 == address2) {
-        sizefile = fopen((x->path().native()+"/maps/map0/size").c_str(),"r");
-        fgets(sizechar,128,sizefile); fclose(sizefile);
-        //the size was in number of bytes, convert into number of uint32
-        size=std::strtoul( sizechar, 0, 16)/4;  
-        //strcpy(uioName,x->path().filename().native().c_str());
-        uioName = x->path().filename().native();
-        break;
+    // Look the address up in the sysfs index
+    std::unordered_map<uint64_t,std::string>::const_iterator itAddr = sysfsByAddr.find(address1);
+    if ((address1 != 0) && (itAddr != sysfsByAddr.end())) {
+      //the size was in number of bytes, convert into number of uint32
+      size = sysfsByName[itAddr->second].size/4;
+      uioName = itAddr->second;
+      if ((itLabel->second.size != 0) && (itLabel->second.size != sysfsByName[uioName].size)) {
+        log (Debug(), "Device-tree size of ", nodeId.c_str(), " does not match the size of map0 of ", uioName.c_str());
       }
     }
 
@@ -307,47 +384,398 @@ namespace uhal {
     devices[nodeAddress].uioName = uioName;
     devices[nodeAddress].hwNodeName = nodeId;
     devices[nodeAddress].size = size;
+    //(mapped later by mapDevice)
+  }
 
-    // map the memory
-    openDevice(devices[nodeAddress]);
-    
 
-    if (NULL != getenv("UIOUHAL_DEBUG")) {
-      printf("Added:\n");
-      printf("  uhal addr: 0x%08X\n",devices[nodeAddress].uhalAddr);
-      printf("  addr:      0x%016" PRIX64 "\n",devices[nodeAddress].addr);
-      printf("  uio name:  \"%s\"\n",devices[nodeAddress].uioName.c_str());
-      printf("  hw  name:  \"%s\"\n",devices[nodeAddress].hwNodeName.c_str());
-      printf("  size:      0x%08X\n",devices[nodeAddress].size);
-      printf("  map:       %p\n"    ,devices[nodeAddress].hw);
+  //FNV-1a, only used to name and validate discovery cache files
+  static const uint64_t fnvOffset = 0xcbf29ce484222325ULL;
+  static uint64_t fnv1a(uint64_t hash, void const * data, size_t size) {
+    uint8_t const * bytes = static_cast<uint8_t const *>(data);
+    for (size_t iByte = 0; iByte < size; iByte++) {
+      hash = (hash ^ bytes[iByte]) * 0x100000001b3ULL;
     }
+    return hash;
+  }
 
-    //Check that the device (will throw if it is bad)
-    checkDevice(devices[nodeAddress]);
+  //Hash of the device-tree: the flattened tree the kernel booted with, plus the names of the nodes
+  //on the amba buses, which also catches overlays (e.g. firmware loaded after boot)
+  //(the fdt is only looked at for the real device-tree, not for one under a dt_root)
+  static uint64_t deviceTreeKey(std::string const & dvtpath) {
+    uint64_t hash = fnvOffset;
+    std::vector<uint8_t> data;
+    if ((dvtpath == "/proc/device-tree/") && readDTProperty("/sys/firmware/fdt", data)) {
+      hash = fnv1a(hash, data.data(), data.size());
+    }
+    if (is_directory(dvtpath)) {
+      std::vector<std::string> nodes;
+      for (directory_iterator itDVTPath(dvtpath); itDVTPath!=directory_iterator(); ++itDVTPath) {
+        if ((!is_directory(itDVTPath->path())) || (itDVTPath->path().filename().native().find("amba")==std::string::npos)) {
+          continue;
+        }
+        for (directory_iterator x(itDVTPath->path()); x!=directory_iterator(); ++x) {
+          nodes.push_back(itDVTPath->path().filename().native() + "/" + x->path().filename().native());
+        }
+      }
+      std::sort(nodes.begin(), nodes.end());
+      for (size_t iNode = 0; iNode < nodes.size(); iNode++) {
+        hash = fnv1a(hash, nodes[iNode].c_str(), nodes[iNode].size()+1);
+      }
+    }
+    return hash;
+  }
 
+  //The address table file and every module file it includes (false if they can't all be found)
+  static bool addressTableFiles(std::string const & tablePath, std::vector<std::string> & files) {
+    if (std::find(files.begin(), files.end(), tablePath) != files.end()) {
+      return true;
+    }
+    files.push_back(tablePath);
+    pugi::xml_document doc;
+    if (!doc.load_file(tablePath.c_str())) {
+      return false;
+    }
+    std::vector<pugi::xml_node> nodes(1, doc.document_element());
+    while (!nodes.empty()) {
+      pugi::xml_node node = nodes.back();
+      nodes.pop_back();
+      pugi::xml_attribute module = node.attribute("module");
+      if (module) {
+        std::string modulePath = module.value();
+        if (modulePath.compare(0, 7, "file://") == 0) {
+          modulePath = modulePath.substr(7);
+        }
+        if (modulePath.empty() || (modulePath.find_first_of("*?[") != std::string::npos)) {
+          return false; //wildcards are expanded by uHAL, we can't follow them
+        }
+        if (modulePath[0] != '/') {
+          modulePath = (path(tablePath).parent_path() / modulePath).native();
+        }
+        if (!addressTableFiles(modulePath, files)) {
+          return false;
+        }
+      }
+      for (pugi::xml_node child = node.first_child(); child; child = child.next_sibling()) {
+        if (child.type() == pugi::node_element) {
+          nodes.push_back(child);
+        }
+      }
+    }
+    return true;
   }
 
+  std::string UIO::discoveryCacheFile(std::string const & cacheDir, std::string const & addressTable) {
+    std::string key = absolute(addressTable).native() + "\n" + devRoot + "\n" + sysfsRoot + "\n" + dtRoot;
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".cache",
+	     fnv1a(deviceTreeKey(dtRoot), key.c_str(), key.size()));
+    return cacheDir + "/" + name;
+  }
 
-  void UIO::openDevice(sUIODevice & dev) {
-    std::string devpath = "/dev/" + dev.uioName;
-    dev.fd = open(devpath.c_str(), O_RDWR|O_SYNC);
-    if (-1==dev.fd) {
+  //A cached endpoint, as read from the cache file
+  struct sUIOCachedDevice {
+    uint32_t uhalAddr;
+    uint64_t addr;
+    size_t   size;
+    uint32_t burstWidth;
+    uint32_t flags;
+    uint32_t mapIndex;
+    uint32_t parentAddr; //the endpoint a map belongs to
+    char uioName[128];   //what is opened in /dev (uioN or uio_NAME)
+    char sysfsName[128]; //the uioN it resolved to
+    char hwNodeName[256];
+  };
+
+  bool UIO::loadDiscoveryCache(std::string const & cacheFile, std::string const & addressTable) {
+    FILE *cache = fopen(cacheFile.c_str(), "r");
+    if (cache == NULL) {
+      return false;
+    }
+    std::string tablePath = absolute(addressTable).native();
+    std::vector<sUIOCachedDevice> cachedDevices;
+    std::vector< std::pair<uint32_t,uint32_t> > cachedFlags;
+    bool valid = true;
+    int iLine = 0;
+    char line[1024];
+    while (valid && (NULL != fgets(line, sizeof(line), cache))) {
+      line[strcspn(line, "\n")] = '\0';
+      if (0 == iLine++) {
+        valid = (0 == strcmp(line, "uiouhal-cache 3"));
+      } else if (0 == strncmp(line, "table ", 6)) {
+        valid = (tablePath == (line + 6));
+      } else if (0 == strncmp(line, "file ", 5)) {
+        //an address table file has to be exactly as it was when the cache was written
+        long long fileSize, mtimeSec, mtimeNsec;
+        int pathStart = 0;
+        struct stat fileStat;
+        valid = (3 == sscanf(line, "file %lld %lld %lld %n", &fileSize, &mtimeSec, &mtimeNsec, &pathStart)) &&
+	  (pathStart > 0) && (0 == stat(line + pathStart, &fileStat)) &&
+	  (fileStat.st_size == fileSize) &&
+	  (fileStat.st_mtim.tv_sec == mtimeSec) && (fileStat.st_mtim.tv_nsec == mtimeNsec);
+      } else if (0 == strncmp(line, "device ", 7)) {
+        sUIOCachedDevice dev;
+        valid = (10 == sscanf(line, "device %x %" SCNx64 " %zx %u %x %u %x %127s %127s %255s",
+			      &dev.uhalAddr, &dev.addr, &dev.size, &dev.burstWidth, &dev.flags, &dev.mapIndex,
+			      &dev.parentAddr, dev.uioName, dev.sysfsName, dev.hwNodeName));
+        cachedDevices.push_back(dev);
+      } else if (0 == strncmp(line, "register ", 9)) {
+        std::pair<uint32_t,uint32_t> regFlags;
+        valid = (2 == sscanf(line, "register %x %x", &regFlags.first, &regFlags.second));
+        cachedFlags.push_back(regFlags);
+      } else {
+        valid = false;
+      }
+    }
+    fclose(cache);
+
+    //the uio devices have to still be where they were (uioN numbering is not fixed across boots)
+    for (size_t iDev = 0; valid && iDev < cachedDevices.size(); iDev++) {
+      sUIOCachedDevice const & dev = cachedDevices[iDev];
+      uint64_t mapAddr = 0;
+      uint64_t mapSize = 0;
+      std::string sysfsPath = sysfsRoot + dev.sysfsName + "/maps/map" + std::to_string(dev.mapIndex) + "/";
+      valid = readSysfsValue(sysfsPath + "addr", mapAddr) && (mapAddr == dev.addr) &&
+	readSysfsValue(sysfsPath + "size", mapSize) && (mapSize/4 == dev.size);
+      if (valid && (0 != strcmp(dev.uioName, dev.sysfsName))) {
+        char target[256];
+        ssize_t targetSize = readlink((devRoot + dev.uioName).c_str(), target, sizeof(target)-1);
+        valid = (targetSize > 0);
+        if (valid) {
+          target[targetSize] = '\0';
+          valid = (path(target).filename().native() == dev.sysfsName);
+        }
+      }
+    }
+    if (!valid || cachedDevices.empty()) {
+      log (Debug(), "Discovery cache ", cacheFile.c_str(), " is out of date");
+      return false;
+    }
+
+    std::vector<sUIODevice*> toMap;
+    for (size_t iDev = 0; iDev < cachedDevices.size(); iDev++) {
+      sUIOCachedDevice const & cached = cachedDevices[iDev];
+      sUIODevice & dev = devices[cached.uhalAddr];
+      dev.uhalAddr   = cached.uhalAddr;
+      dev.addr       = cached.addr;
+      dev.uioName    = cached.uioName;
+      dev.hwNodeName = cached.hwNodeName;
+      dev.size       = cached.size;
+      dev.burstWidth = cached.burstWidth;
+      dev.flags      = cached.flags;
+      dev.mapIndex   = cached.mapIndex;
+      dev.parentAddr = cached.parentAddr;
+      toMap.push_back(&dev);
+    }
+    if (!lazy) {
+      mapDevices(toMap);
+    }
+    for (size_t iReg = 0; iReg < cachedFlags.size(); iReg++) {
+      registerFlags[cachedFlags[iReg].first] = cachedFlags[iReg].second;
+    }
+    return true;
+  }
+
+  void UIO::saveDiscoveryCache(std::string const & cacheFile, std::string const & addressTable) {
+    std::string tablePath = absolute(addressTable).native();
+    std::vector<std::string> files;
+    if (!addressTableFiles(tablePath, files)) {
+      log (Debug(), "Not caching discovery, can't find all the files of ", tablePath.c_str());
+      return;
+    }
+
+    //written to a temporary file and renamed, so concurrent clients never see half a cache
+    mkdir(path(cacheFile).parent_path().c_str(), 0755);
+    std::string tmpFile = cacheFile + "." + std::to_string(getpid());
+    FILE *cache = fopen(tmpFile.c_str(), "w");
+    if (cache == NULL) {
+      log (Debug(), "Not caching discovery, can't write ", tmpFile.c_str(), ": ", strerror(errno));
+      return;
+    }
+    bool ok = (0 < fprintf(cache, "uiouhal-cache 3\ntable %s\n", tablePath.c_str()));
+    for (size_t iFile = 0; ok && iFile < files.size(); iFile++) {
+      struct stat fileStat;
+      ok = (0 == stat(files[iFile].c_str(), &fileStat)) &&
+	(0 < fprintf(cache, "file %lld %lld %lld %s\n", (long long) fileStat.st_size,
+		     (long long) fileStat.st_mtim.tv_sec, (long long) fileStat.st_mtim.tv_nsec, files[iFile].c_str()));
+    }
+    for (std::map<uint32_t,sUIODevice>::iterator itDev = devices.begin(); ok && itDev != devices.end(); itDev++) {
+      sUIODevice const & dev = itDev->second;
+      std::unordered_map<std::string,std::string>::const_iterator itLink = uioSymlinks.find(dev.uioName);
+      std::string sysfsName = (itLink != uioSymlinks.end()) ? itLink->second : dev.uioName;
+      ok = (0 < fprintf(cache, "device %x %" PRIx64 " %zx %u %x %u %x %s %s %s\n",
+			dev.uhalAddr, dev.addr, dev.size, dev.burstWidth, dev.flags, dev.mapIndex,
+			dev.parentAddr, dev.uioName.c_str(), sysfsName.c_str(), dev.hwNodeName.c_str()));
+    }
+    for (std::unordered_map<uint32_t,uint32_t>::iterator itReg = registerFlags.begin(); ok && itReg != registerFlags.end(); itReg++) {
+      ok = (0 < fprintf(cache, "register %x %x\n", itReg->first, itReg->second));
+    }
+    ok = (0 == fclose(cache)) && ok;
+    if (!ok || (0 != rename(tmpFile.c_str(), cacheFile.c_str()))) {
+      log (Debug(), "Not caching discovery, failed to write ", cacheFile.c_str());
+      unlink(tmpFile.c_str());
+    }
+  }
+
+  //Process-wide registry of mappings, so that all the UIO clients using a /dev/uioN share one fd and mmap.
+  //Entries are weak, the mapping goes away with the last client using it
+  static std::mutex mappingsMutex;
+  static std::map<std::string, std::weak_ptr<sUIOMapping> > mappings;
+  //The RMW lock of each device, under the same key.  Kept apart from the mappings, as a device mapped again
+  //with more bytes has an old mapping and a new one in use at once, and RMWs through either must exclude
+  //each other
+  static std::map<std::string, std::weak_ptr<std::mutex> > rmwLocks;
+
+  static std::shared_ptr<sUIOMapping> sharedMapping(std::string const & devpath, size_t bytes, uint32_t mapIndex) {
+    //keyed by the real device and map, so /dev/uio_NAME and /dev/uioN share a mapping
+    char resolved[PATH_MAX];
+    std::string key = ((NULL != realpath(devpath.c_str(), resolved)) ? std::string(resolved) : devpath) +
+      ":" + std::to_string(mapIndex);
+    {
+      std::lock_guard<std::mutex> lock(mappingsMutex);
+      std::shared_ptr<sUIOMapping> mapping = mappings[key].lock();
+      if (mapping && (mapping->bytes >= bytes)) {
+	log ( Debug(), "Sharing the mapping of ", key);
+	return mapping;
+      }
+    }
+
+    //open and map outside of the lock, so that threads mapping different devices don't wait on each other
+    std::shared_ptr<sUIOMapping> mapping = std::make_shared<sUIOMapping>();
+    mapping->devPath = key.substr(0, key.rfind(':'));
+    mapping->mapIndex = mapIndex;
+    mapping->fd = open(devpath.c_str(), O_RDWR|O_SYNC);
+    if (-1==mapping->fd) {
       uhal::exception::BadUIODevice* lExc = new uhal::exception::BadUIODevice();
       log( *lExc , "Failed to open ", devpath, ": ", strerror(errno));
       throw *lExc;
     }
-    dev.hw = (uint32_t*)mmap(NULL, dev.size*sizeof(uint32_t),
-			                      PROT_READ|PROT_WRITE, MAP_SHARED,
-			                      dev.fd, 0x0);
-    if (dev.hw==MAP_FAILED) {
+    //the uio driver selects map N with an offset of N pages
+    mapping->hw = (uint32_t*)mmap(NULL, bytes,
+				  PROT_READ|PROT_WRITE, MAP_SHARED,
+				  mapping->fd, (off_t) mapIndex * sysconf(_SC_PAGESIZE));
+    if (mapping->hw==MAP_FAILED) {
       uhal::exception::BadUIODevice* lExc = new uhal::exception::BadUIODevice();
-      log ( Debug() , "Failed to map ", devpath, ": ",  strerror(errno));
-      dev.hw=NULL;
-      throw lExc;
+      log ( *lExc , "Failed to map ", devpath, ": ",  strerror(errno));
+      mapping->hw=NULL;
+      throw *lExc; //(the fd is closed with mapping)
+    }
+    mapping->bytes = bytes;
+    log ( Debug(), "Mapped ", devpath, " map ", Integer(mapIndex),
+	  " size ", Integer( bytes, IntFmt<hex, fixed>()));
+
+    std::lock_guard<std::mutex> lock(mappingsMutex);
+    std::shared_ptr<sUIOMapping> existing = mappings[key].lock();
+    if (existing && (existing->bytes >= bytes)) {
+      return existing; //another thread mapped it in the meantime, ours is dropped
+    }
+    mapping->rmwLock = rmwLocks[key].lock();
+    if (!mapping->rmwLock) {
+      mapping->rmwLock = std::make_shared<std::mutex>();
+      rmwLocks[key] = mapping->rmwLock;
+    }
+    mappings[key] = mapping;
+    return mapping;
+  }
+
+  void UIO::openDevice(sUIODevice & dev) {
+    dev.mapping = sharedMapping(devRoot + dev.uioName, dev.size*sizeof(uint32_t), dev.mapIndex);
+    dev.fd = dev.mapping->fd;
+    dev.hw = dev.mapping->hw;
+  }
+
+  void UIO::resolveDevice(sUIODevice & dev) {
+    if (0 == dev.mapIndex) {
+      //an endpoint: the find functions start the device from scratch, so keep the address table options
+      std::string name = dev.hwNodeName;
+      uint32_t burstWidth = dev.burstWidth;
+      uint32_t flags = dev.flags;
+      if (!symlinkFindUIO(name, dev.uhalAddr)) {
+	dtFindUIO(name, dev.uhalAddr);
+      }
+      dev.burstWidth = burstWidth;
+      dev.flags = flags;
+      return;
+    }
+
+    //another map of the uio device of an endpoint
+    std::map<uint32_t,sUIODevice>::iterator itParent = devices.find(dev.parentAddr);
+    if (itParent == devices.end()) {
+      uhal::exception::BadUIODevice* lExc = new uhal::exception::BadUIODevice();
+      log (*lExc, "No endpoint at ", Integer(dev.parentAddr, IntFmt<hex, fixed>()), " for the map ", dev.hwNodeName);
+      throw *lExc;
+    }
+    sUIODevice & parent = itParent->second;
+    if (parent.uioName.empty()) {
+      resolveDevice(parent);
+    }
+    std::unordered_map<std::string,std::string>::const_iterator itLink = uioSymlinks.find(parent.uioName);
+    std::string sysfsName = (itLink != uioSymlinks.end()) ? itLink->second : parent.uioName;
+    std::unordered_map<std::string,sUIOSysfsEntry>::const_iterator itSysfs = sysfsByName.find(sysfsName);
+    if ((itSysfs == sysfsByName.end()) || (dev.mapIndex >= itSysfs->second.mapAddr.size())) {
+      uhal::exception::BadUIODevice* lExc = new uhal::exception::BadUIODevice();
+      log (*lExc, "uio device of ", parent.hwNodeName, " has no map", Integer(dev.mapIndex), " for ", dev.hwNodeName);
+      throw *lExc;
+    }
+    dev.uioName = parent.uioName;
+    dev.addr = itSysfs->second.mapAddr[dev.mapIndex];
+    dev.size = itSysfs->second.mapSize[dev.mapIndex]/4;
+  }
+
+  void UIO::mapDevice(sUIODevice & dev) {
+    // map the memory
+    openDevice(dev);
+
+    if (NULL != getenv("UIOUHAL_DEBUG")) {
+      //one printf, so that devices mapped by different threads don't interleave
+      printf("Added:\n"
+	     "  uhal addr: 0x%08X\n"
+	     "  addr:      0x%016" PRIX64 "\n"
+	     "  uio name:  \"%s\"\n"
+	     "  hw  name:  \"%s\"\n"
+	     "  size:      0x%08zX\n"
+	     "  map%-2u:     %p\n",
+	     dev.uhalAddr, dev.addr, dev.uioName.c_str(), dev.hwNodeName.c_str(), dev.size, dev.mapIndex, dev.hw);
+    }
+
+    //Check that the device (will throw if it is bad)
+    checkDevice(dev);
+  }
+
+  void UIO::mapDevices(std::vector<sUIODevice*> const & devs) {
+    size_t threadCount = mapThreads ? mapThreads : std::min(4u, std::max(1u, std::thread::hardware_concurrency()));
+    threadCount = std::min(threadCount, devs.size());
+
+    //each thread takes the next unmapped device until there are none left
+    std::vector<std::exception_ptr> errors(devs.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+      for (size_t iDev = next++; iDev < devs.size(); iDev = next++) {
+	try {
+	  mapDevice(*devs[iDev]);
+	} catch (...) {
+	  errors[iDev] = std::current_exception();
+	}
+      }
+    };
+    std::vector<std::thread> pool;
+    for (size_t iThread = 1; iThread < threadCount; iThread++) {
+      try {
+	pool.push_back(std::thread(worker));
+      } catch (std::system_error &) {
+	break; //carry on with the threads we have
+      }
+    }
+    worker();
+    for (size_t iThread = 0; iThread < pool.size(); iThread++) {
+      pool[iThread].join();
+    }
+
+    //report the first failure in the order we were given the devices, whichever thread hit it first
+    for (size_t iDev = 0; iDev < errors.size(); iDev++) {
+      if (errors[iDev]) {
+	std::rethrow_exception(errors[iDev]);
+      }
     }
-    log ( Debug(), "Mapped ", devpath,
-	  " size ", Integer( dev.size, IntFmt<hex, fixed>()));
-    
   }
 
   int UIO::checkDevice (sUIODevice & dev) {
@@ -360,4 +788,27 @@ namespace uhal {
     }
     return 0;
   }
+
+  void UIO::buildAddrTable() {
+    //devices is already sorted by uhal address, so this is a straight copy
+    addrTableBase.clear();
+    addrTable.clear();
+    addrTableBase.reserve(devices.size());
+    addrTable.reserve(devices.size());
+    for (std::map<uint32_t,sUIODevice>::iterator itDev = devices.begin(); itDev != devices.end(); itDev++) {
+      sUIOAddrEntry entry;
+      entry.uhalAddr = itDev->second.uhalAddr;
+      entry.size.store((NULL != itDev->second.hw) ? itDev->second.size : 0, std::memory_order_relaxed); //unmapped (lazy) endpoints look empty
+      entry.hw       = itDev->second.hw;
+      entry.dev      = &(itDev->second);
+      entry.burstWidth = itDev->second.burstWidth;
+      entry.flags      = itDev->second.flags;
+      if (!addrTable.empty() && (addrTable.back().dev->uhalAddr + addrTable.back().dev->size > entry.uhalAddr)) {
+        log (Warning(), addrTable.back().dev->hwNodeName, " overlaps ", itDev->second.hwNodeName,
+	     ", the end of ", addrTable.back().dev->hwNodeName, " can't be reached");
+      }
+      addrTableBase.push_back(entry.uhalAddr);
+      addrTable.push_back(entry);
+    }
+  }
 }
@@ -0,0 +1,487 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <chrono>
+#include "uhal/log/LogLevels.hpp"
+#include "uhal/log/log_inserters.integer.hpp"
+#include "uhal/log/log.hpp"
+
+#include <ProtocolUIO.hpp>
+
+namespace uioaxi {
+
+  sUIOIRQ::sUIOIRQ() :
+    fd(-1),
+    count(0),
+    countRead(false),
+    missed(0),
+    ringCount(0),
+    ringEnable(1),
+    ringReading(false){
+  }
+
+  sUIOIRQ::~sUIOIRQ()
+  {
+    if(fd != -1){
+      close(fd);
+    }
+  }
+}//uioaxi namespace
+
+
+using namespace uioaxi;
+
+//io_uring request tags.  An endpoint's interrupt read is tagged with its sUIODevice*, whose low two bits
+//are free for the other kinds of request
+enum eRingTag{
+  RING_TAG_READ    = 0, //sUIODevice*
+  RING_TAG_ARM     = 1, //sUIODevice* | 1
+  RING_TAG_TIMEOUT = 2, //(timeout number << 2) | 2
+  RING_TAG_OTHER   = 3
+};
+static uint64_t const RING_WAKE   = 3; //read of irqWakeFd
+static uint64_t const RING_CANCEL = 7;
+
+
+namespace uhal {
+
+  sUIODevice & UIO::irqDevice(uint32_t aAddr) {
+    //a map shares its endpoint's uio device and so its interrupt
+    sUIODevice * dev = lookupAddr(aAddr).dev;
+    std::lock_guard<std::mutex> lock(deviceMutex); //(threads can wait on different endpoints at once)
+    if (0 != dev->mapIndex) {
+      std::map<uint32_t,sUIODevice>::iterator itParent = devices.find(dev->parentAddr);
+      if (itParent == devices.end()) {
+	uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+	log (*lExc, "No endpoint at ", Integer(dev->parentAddr, IntFmt<hex, fixed>()), " for the interrupt of ", dev->hwNodeName);
+	throw *lExc;
+      }
+      dev = &itParent->second;
+      if (dev->uioName.empty()) {
+	resolveDevice(*dev); //lazy client, endpoint not used yet
+      }
+    }
+
+    if (!dev->irq) {
+      std::string devpath = devRoot + dev->uioName;
+      std::shared_ptr<sUIOIRQ> irq = std::make_shared<sUIOIRQ>();
+      irq->fd = open(devpath.c_str(), O_RDWR|O_CLOEXEC);
+      if (-1 == irq->fd) {
+	uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+	log (*lExc, "Failed to open ", devpath, " for the interrupt of ", dev->hwNodeName, ": ", strerror(errno));
+	throw *lExc;
+      }
+      dev->irq = irq;
+    }
+    return *dev;
+  }
+
+  void UIO::armIRQ (const uint32_t& aAddr) {
+    sUIODevice & dev = irqDevice(aAddr);
+
+    //keep program order with anything still queued (e.g. the writes that set up the interrupt)
+    executeTransactions();
+
+    //the uio irqcontrol interface: writing 1 enables the interrupt
+    uint32_t enable = 1;
+    if ((ssize_t) sizeof(enable) != ::write(dev.irq->fd, &enable, sizeof(enable))) {
+      uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+      log (*lExc, "Failed to arm the interrupt of ", dev.hwNodeName, ": ", strerror(errno));
+      throw *lExc;
+    }
+  }
+
+  uint32_t UIO::waitIRQ (const uint32_t& aAddr, const uint32_t& aTimeout) {
+    sUIODevice & dev = irqDevice(aAddr);
+    executeTransactions();
+
+    uint64_t timeout = aTimeout ? aTimeout : getTimeoutPeriod();
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    struct pollfd pfd;
+    pfd.fd = dev.irq->fd;
+    pfd.events = POLLIN;
+    int ready;
+    do {
+      //(signals restart the wait with whatever is left of the timeout)
+      int64_t remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+      pfd.revents = 0;
+      ready = poll(&pfd, 1, (remaining > 0) ? remaining : 0);
+    } while ((ready < 0) && (errno == EINTR));
+
+    if (0 == ready) {
+      uhal::exception::UIOIRQTimeout* lExc = new uhal::exception::UIOIRQTimeout();
+      log (*lExc, "No interrupt from ", dev.hwNodeName, " within ", Integer(timeout), " ms");
+      throw *lExc;
+    }
+
+    //the uio driver returns the number of interrupts so far
+    uint32_t count = 0;
+    if ((ready < 0) || ((ssize_t) sizeof(count) != ::read(dev.irq->fd, &count, sizeof(count)))) {
+      uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+      log (*lExc, "Failed to read the interrupt of ", dev.hwNodeName, ": ", strerror(errno));
+      throw *lExc;
+    }
+    countIRQ(dev, count);
+    return count;
+  }
+
+  void UIO::countIRQ(sUIODevice & dev, uint32_t aCount) {
+    //a jump of more than one means interrupts fired while the previous one was being handled
+    if (dev.irq->countRead && (aCount - dev.irq->count > 1)) {
+      dev.irq->missed += aCount - dev.irq->count - 1;
+    }
+    dev.irq->count = aCount;
+    dev.irq->countRead = true;
+  }
+
+  void UIO::addIRQHandler (const uint32_t& aAddr, std::function<void(std::string const &, uint32_t)> aHandler) {
+    sUIODevice & dev = irqDevice(aAddr);
+
+    if ((-1 == irqWakeFd) && irqUseRing) {
+      setupIRQRing(); //falls back to epoll if it can't
+    }
+    if ((-1 == irqWakeFd) && !irqUseRing) {
+      irqEpollFd = epoll_create1(EPOLL_CLOEXEC);
+      irqWakeFd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+      struct epoll_event event;
+      event.events = EPOLLIN;
+      event.data.ptr = NULL; //the wake up eventfd
+      if ((-1 == irqEpollFd) || (-1 == irqWakeFd) ||
+	  (0 != epoll_ctl(irqEpollFd, EPOLL_CTL_ADD, irqWakeFd, &event))) {
+	uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+	log (*lExc, "Failed to set up the interrupt event loop: ", strerror(errno));
+	closeIRQs();
+	throw *lExc;
+      }
+    }
+
+    if (irqUseRing) {
+      if (!dev.irq->ringReading) {
+	queueIRQRead(dev, false); //goes to the kernel with the next serviceIRQs
+      }
+    } else if (!dev.irq->handler) {
+      struct epoll_event event;
+      event.events = EPOLLIN;
+      event.data.ptr = &dev; //devices never moves its elements
+      if (0 != epoll_ctl(irqEpollFd, EPOLL_CTL_ADD, dev.irq->fd, &event)) {
+	uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+	log (*lExc, "Failed to add the interrupt of ", dev.hwNodeName, " to the event loop: ", strerror(errno));
+	throw *lExc;
+      }
+    }
+    dev.irq->handler = aHandler;
+    armIRQ(aAddr);
+  }
+
+  void UIO::removeIRQHandler (const uint32_t& aAddr) {
+    sUIODevice & dev = irqDevice(aAddr);
+    if (dev.irq->handler) {
+      if (!irqUseRing) {
+	epoll_ctl(irqEpollFd, EPOLL_CTL_DEL, dev.irq->fd, NULL);
+      } else if (dev.irq->ringReading) {
+	irqRing.queueCancel((uint64_t) (uintptr_t) &dev, RING_CANCEL);
+      }
+      dev.irq->handler = nullptr;
+    }
+  }
+
+  uint32_t UIO::serviceIRQs (const int32_t& aTimeout) {
+    if (-1 == irqWakeFd) {
+      return 0; //no handlers
+    }
+    if (irqUseRing) {
+      return serviceIRQRing(aTimeout);
+    }
+
+    struct epoll_event events[64];
+    int ready = epoll_wait(irqEpollFd, events, 64, aTimeout);
+    if (ready < 0) {
+      if (errno == EINTR) {
+	return 0;
+      }
+      uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+      log (*lExc, "Failed to wait for interrupts: ", strerror(errno));
+      throw *lExc;
+    }
+
+    uint32_t serviced = 0;
+    for (int iEvent = 0; iEvent < ready; iEvent++) {
+      if (NULL == events[iEvent].data.ptr) {
+	uint64_t wakes;
+	ssize_t drained = ::read(irqWakeFd, &wakes, sizeof(wakes)); //clear it, the count doesn't matter
+	(void) drained;
+	continue;
+      }
+      sUIODevice & dev = *static_cast<sUIODevice*>(events[iEvent].data.ptr);
+      if (!dev.irq->handler) {
+	continue; //removed by an earlier handler in this batch
+      }
+      uint32_t count = 0;
+      if ((ssize_t) sizeof(count) != ::read(dev.irq->fd, &count, sizeof(count))) {
+	uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+	log (*lExc, "Failed to read the interrupt of ", dev.hwNodeName, ": ", strerror(errno));
+	throw *lExc;
+      }
+      countIRQ(dev, count);
+      dev.irq->handler(dev.hwNodeName, count);
+
+      //arm it again for the next one (level interrupts that are still asserted fire again straight away)
+      uint32_t enable = 1;
+      if ((ssize_t) sizeof(enable) != ::write(dev.irq->fd, &enable, sizeof(enable))) {
+	uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+	log (*lExc, "Failed to re-arm the interrupt of ", dev.hwNodeName, ": ", strerror(errno));
+	throw *lExc;
+      }
+      serviced++;
+    }
+    return serviced;
+  }
+
+  void UIO::setupIRQRing() {
+    int error = irqRing.setup(256);
+    if (0 == error) {
+      irqWakeFd = eventfd(0, EFD_CLOEXEC);
+      if (-1 == irqWakeFd) {
+	error = errno;
+      } else if (!irqRing.queueRead(irqWakeFd, &irqRing.wakeBuffer, sizeof(irqRing.wakeBuffer), RING_WAKE)) {
+	error = EBUSY;
+      } else {
+	irqRing.wakeReading = true;
+      }
+    }
+    if (0 != error) {
+      log(Warning(), "io_uring can't be used for the interrupt loop (", strerror(error), "), using epoll");
+      if (-1 != irqWakeFd) {
+	close(irqWakeFd);
+	irqWakeFd = -1;
+      }
+      irqUseRing = false;
+    }
+  }
+
+  void UIO::queueIRQRead(sUIODevice & dev, bool aArm) {
+    //the re-arm is linked to the read, so the read only starts once the interrupt is enabled again
+    uint64_t tag = (uint64_t) (uintptr_t) &dev;
+    if ((aArm && !irqRing.queueWrite(dev.irq->fd, &dev.irq->ringEnable, sizeof(dev.irq->ringEnable), tag | RING_TAG_ARM, true)) ||
+	!irqRing.queueRead(dev.irq->fd, &dev.irq->ringCount, sizeof(dev.irq->ringCount), tag)) {
+      uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+      log (*lExc, "Failed to queue the interrupt read of ", dev.hwNodeName);
+      throw *lExc;
+    }
+    dev.irq->ringReading = true;
+  }
+
+  //The timeout of a serviceIRQRing call that has not expired yet.  Removed from the ring however the
+  //call returns, so a loop woken mostly by interrupts doesn't pile up pending timeouts in the kernel
+  struct sUIORingTimeout{
+    sUIORingTimeout(sUIORing & aRing) : ring(aRing), tag(0) {}
+    ~sUIORingTimeout() {
+      if (0 != tag) {
+	ring.queueTimeoutRemove(tag, RING_CANCEL);
+	ring.submit(0);
+      }
+    }
+    sUIORing & ring;
+    uint64_t tag; //0 once it has expired or been removed
+  };
+
+  uint32_t UIO::serviceIRQRing(int32_t aTimeout) {
+    //The timeout is a request in the ring like the reads.  Each call tags its own, so the -ECANCELED
+    //completion of one removed after an earlier call returned is told apart from the current one
+    sUIORingTimeout timeout(irqRing);
+    if (aTimeout > 0) {
+      uint64_t timeoutTag = (++irqRingTimeouts << 2) | RING_TAG_TIMEOUT;
+      if (!irqRing.queueTimeout(aTimeout, timeoutTag)) {
+	//(waiting without it could block for ever)
+	uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+	log (*lExc, "Failed to queue the timeout of the interrupt loop");
+	throw *lExc;
+      }
+      timeout.tag = timeoutTag;
+    }
+
+    uint32_t serviced = 0;
+    bool done = false;
+    while (!done) {
+      //submits whatever was queued since the last call (new handlers, cancels) with the wait
+      int ret = irqRing.submit((0 == aTimeout) ? 0 : 1);
+      if (ret == -EINTR) {
+	return serviced;
+      } else if (ret < 0) {
+	uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+	log (*lExc, "Failed to wait for interrupts: ", strerror(-ret));
+	throw *lExc;
+      }
+      done = (0 == aTimeout);
+
+      uint64_t tag;
+      int32_t result;
+      while (irqRing.completion(tag, result)) {
+	if (RING_WAKE == tag) {
+	  irqRing.wakeReading = irqRing.queueRead(irqWakeFd, &irqRing.wakeBuffer, sizeof(irqRing.wakeBuffer), RING_WAKE);
+	  if (!irqRing.wakeReading) {
+	    uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+	    log (*lExc, "Failed to queue the read of the interrupt loop's wake event");
+	    throw *lExc;
+	  }
+	  done = true;
+	  continue;
+	} else if ((tag & 3) == RING_TAG_TIMEOUT) {
+	  if (tag == timeout.tag) {
+	    timeout.tag = 0;
+	    done = true;
+	  }
+	  continue;
+	} else if ((tag & 3) != RING_TAG_READ) {
+	  if (((tag & 3) == RING_TAG_ARM) && (result < 0)) {
+	    sUIODevice & dev = *(sUIODevice *) (uintptr_t) (tag & ~((uint64_t) 3));
+	    uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+	    log (*lExc, "Failed to re-arm the interrupt of ", dev.hwNodeName, ": ", strerror(-result));
+	    throw *lExc;
+	  }
+	  continue; //cancels and timeout removals
+	}
+
+	sUIODevice & dev = *(sUIODevice *) (uintptr_t) tag;
+	dev.irq->ringReading = false;
+	if ((result != -ECANCELED) && (result != (int32_t) sizeof(dev.irq->ringCount))) {
+	  uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+	  log (*lExc, "Failed to read the interrupt of ", dev.hwNodeName, ": ", strerror((result < 0) ? -result : EIO));
+	  throw *lExc;
+	}
+	if (!dev.irq->handler) {
+	  continue; //removed since
+	}
+	//queue the re-arm and the next read first (they are only submitted below, once every handler has run),
+	//so an exception from the handler doesn't leave the endpoint out of the loop
+	queueIRQRead(dev, true);
+	if (result == -ECANCELED) {
+	  continue; //removed, then added again before the cancel went through
+	}
+	uint32_t count = dev.irq->ringCount;
+	countIRQ(dev, count);
+	dev.irq->handler(dev.hwNodeName, count);
+	serviced++;
+	done = true;
+      }
+    }
+
+    //the re-arms and next reads of all the endpoints just served, in one syscall with the timeout removal
+    if (0 != timeout.tag) {
+      irqRing.queueTimeoutRemove(timeout.tag, RING_CANCEL);
+      timeout.tag = 0;
+    }
+    int ret = irqRing.submit(0);
+    if ((ret < 0) && (ret != -EINTR)) {
+      uhal::exception::UIOIRQError* lExc = new uhal::exception::UIOIRQError();
+      log (*lExc, "Failed to re-arm the interrupts: ", strerror(-ret));
+      throw *lExc;
+    }
+    return serviced;
+  }
+
+  void UIO::wakeIRQs () {
+    if (-1 != irqWakeFd) {
+      uint64_t wake = 1;
+      ssize_t written = ::write(irqWakeFd, &wake, sizeof(wake));
+      (void) written;
+    }
+  }
+
+  uint32_t UIO::getMissedIRQs (const uint32_t& aAddr) {
+    return irqDevice(aAddr).irq->missed;
+  }
+
+  void UIO::closeIRQs() {
+    if (irqUseRing && (-1 != irqWakeFd)) {
+      //the kernel must be done with the buffers in the sUIOIRQs before they go
+      uint32_t inFlight = 0;
+      if (irqRing.wakeReading) {
+	irqRing.queueCancel(RING_WAKE, RING_CANCEL);
+	inFlight++;
+      }
+      for (std::map<uint32_t,sUIODevice>::iterator itDev = devices.begin(); itDev != devices.end(); itDev++) {
+	if (itDev->second.irq && itDev->second.irq->ringReading) {
+	  irqRing.queueCancel((uint64_t) (uintptr_t) &(itDev->second), RING_CANCEL);
+	  inFlight++;
+	}
+      }
+      while (inFlight > 0) {
+	int ret = irqRing.submit(1);
+	if ((ret < 0) && (ret != -EINTR)) {
+	  break;
+	}
+	uint64_t tag;
+	int32_t result;
+	while (irqRing.completion(tag, result)) {
+	  if (RING_WAKE == tag) {
+	    irqRing.wakeReading = false;
+	    inFlight--;
+	  } else if ((tag & 3) == RING_TAG_READ) {
+	    inFlight--;
+	  }
+	}
+      }
+    }
+    if (-1 != irqEpollFd) {
+      close(irqEpollFd);
+      irqEpollFd = -1;
+    }
+    if (-1 != irqWakeFd) {
+      close(irqWakeFd);
+      irqWakeFd = -1;
+    }
+  }
+
+}   // namespace uhal
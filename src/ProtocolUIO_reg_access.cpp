@@ -63,12 +63,37 @@
 #include <ProtocolUIO.hpp>
 
 #include <setjmp.h> //for BUS_ERROR signal handling
+#include <mutex>
+#include <unordered_set>
+#include <thread>
+#include <algorithm>
+#include <atomic>
 
 #include <inttypes.h> //for PRI macros
 
 using namespace uioaxi;
 using namespace boost::filesystem;
 
+sUIODispatchStats::sUIODispatchStats() :
+  coalescedRuns(0),
+  coalescedReads(0),
+  squashedWrites(0),
+  combinedRuns(0),
+  combinedWrites(0){
+}
+
+sUIOThreadState::sUIOThreadState() :
+  orphaned(false),
+  transactionCurrent(0){
+}
+
+sUIOWaitResult::sUIOWaitResult() :
+  matched(false),
+  value(0),
+  polls(0),
+  elapsed(0){
+}
+
 //This macro handles the possibility of a SIG_BUS signal and property throws an exception
 //The command you want to run is passed via ACESS and will be in a if{}else{} block, so
 //Call it appropriately. 
@@ -82,59 +107,334 @@ using namespace boost::filesystem;
 // if siglongjmp (in handler) is called, execution returns to this point and acts as if
 // the call returned with the value specified in the second argument of siglongjmp (in handler)
 #define BUS_ERROR_PROTECTION(ACCESS,ADDRESS)					\
-  if(SIGBUS == sigsetjmp(env,1)){						\
-    uhal::exception::UIOBusError * e = new uhal::exception::UIOBusError();\
-    char error_message[] = "Reg: 0x00000000"; \
-    snprintf(error_message,strlen(error_message),"Reg: 0x%08X",ADDRESS); \
-    e->append(error_message); \
-    throw *e;\
+  if(SIGBUS == sigsetjmp(busError.env,1)){				\
+    busError.armed = 0;							\
+    throwBusError(ADDRESS);						\
   }else{ \
+    busError.armed = 1;							\
     ACCESS;					\
+    busError.armed = 0;							\
+  }
+
+//Block version of BUS_ERROR_PROTECTION.
+//A single sigsetjmp guards a whole transfer (ACCESS is normally a loop over many words), so the
+//signal mask is only saved once per block instead of once per word.
+//On a SIG_BUS the faulting address reported by the kernel (si_addr) is translated back into the
+//uhal address of the bad register.  If it doesn't point into DEV, ADDRESS is reported instead.
+#define BUS_ERROR_PROTECTION_BLOCK(ACCESS,DEV,ADDRESS)			\
+  if(SIGBUS == sigsetjmp(busError.env,1)){				\
+    busError.armed = 0;							\
+    throwBusError(faultingAddress(DEV,ADDRESS));				\
+  }else{ \
+    busError.armed = 1;							\
+    ACCESS;					\
+    busError.armed = 0;							\
   }
 
 
 
 //Signal handling for sigbus
-sigjmp_buf static env;
-void static signal_handler(int sig){
-  if(SIGBUS == sig){
-    siglongjmp(env,sig);    //jump back to the point in the stack described by env (set by sigsetjmp) and act like the value "sig" was returned in that context
+//A SIG_BUS caused by a load or store is delivered to the thread that made the access, so the
+//jump buffer is per thread and a fault can only ever jump back into the faulting thread's stack.
+//The context is always touched (armed) by its thread before a fault can happen, so the TLS block
+//already exists when the handler uses it.
+struct sBusErrorContext{
+  sigjmp_buf env;
+  volatile sig_atomic_t armed; //set while this thread is inside a BUS_ERROR_PROTECTION block
+  void * volatile addr;        //address the last SIG_BUS was raised for
+  std::mutex * volatile heldLock; //RMW lock UIO::runTransactions holds, to be released if a fault ends it
+};
+static thread_local sBusErrorContext busError;
+
+//The client this thread used last and its sUIOThreadState there (see UIO::threadState)
+struct sThreadStateCache{
+  uint64_t client;
+  sUIOThreadState * state;
+};
+static thread_local sThreadStateCache threadStateCache = {0, NULL};
+
+//The sUIOThreadStates this thread has made on clients.  Only weak references to the clients' lists,
+//so neither a client nor a thread has to outlive the other
+struct sThreadStateOwner{
+  struct sOwned{
+    uint64_t client;
+    std::weak_ptr<sUIOThreadStates> states;
+    sUIOThreadState * state; //valid while states is (only this thread or its exit removes it)
+  };
+  ~sThreadStateOwner();
+  std::vector<sOwned> owned;
+};
+static thread_local sThreadStateOwner threadStateOwner;
+
+static void dropThreadState(sUIOThreadStates & states, sUIOThreadState * state) {
+  std::lock_guard<std::mutex> lockStates(states.mutex);
+  for (size_t iState = 0; iState < states.states.size(); iState++) {
+    if (states.states[iState].get() == state) {
+      //its counts stay in the client's totals
+      std::shared_ptr<sUIOThreadState> dropped = states.states[iState]; //(freed after its lock is released)
+      std::lock_guard<std::mutex> lock(state->lock);
+      sUIODispatchStats const & stats = state->dispatchStats;
+      states.droppedStats.coalescedRuns  += stats.coalescedRuns;
+      states.droppedStats.coalescedReads += stats.coalescedReads;
+      states.droppedStats.squashedWrites += stats.squashedWrites;
+      states.droppedStats.combinedRuns   += stats.combinedRuns;
+      states.droppedStats.combinedWrites += stats.combinedWrites;
+      states.states.erase(states.states.begin() + iState);
+      return;
+    }
+  }
+}
+
+sThreadStateOwner::~sThreadStateOwner() {
+  //A state with accesses still pending is left to the next dispatch(), which completes the
+  //ValWords etc. another thread may be holding and then drops it
+  for (size_t iOwned = 0; iOwned < owned.size(); iOwned++) {
+    std::shared_ptr<sUIOThreadStates> states = owned[iOwned].states.lock();
+    if (!states) {
+      continue; //the client has gone
+    }
+    sUIOThreadState * state = owned[iOwned].state;
+    bool pending;
+    {
+      std::lock_guard<std::mutex> lock(state->lock);
+      pending = !(state->transactions.empty() && state->valwords.empty() &&
+		  state->valvectors.empty() && state->valheaders.empty());
+      state->orphaned = true;
+    }
+    if (!pending) {
+      dropThreadState(*states, state);
+    }
+  }
+}
+
+//The handler is process wide, so it is installed by the first UIO instance and the previous
+//handler is only restored when the last one goes away
+static std::mutex busErrorHandlerMutex;
+static int busErrorHandlerUsers = 0;
+static struct sigaction saBusError_old;
+
+void static signal_handler(int sig, siginfo_t * info, void * context){
+  if((SIGBUS == sig) && busError.armed){
+    busError.armed = 0;
+    busError.addr = info->si_addr;
+    siglongjmp(busError.env,sig);    //jump back to the point in the stack described by env (set by sigsetjmp) and act like the value "sig" was returned in that context
+  }
+
+  //Not a fault from a protected access, pass it on to whoever had SIG_BUS before us
+  if(saBusError_old.sa_flags & SA_SIGINFO){
+    saBusError_old.sa_sigaction(sig,info,context);
+  }else if((saBusError_old.sa_handler != SIG_DFL) && (saBusError_old.sa_handler != SIG_IGN)){
+    saBusError_old.sa_handler(sig);
+  }else{
+    //Put the default action back; the faulting access re-executes on return and kills the process
+    signal(SIGBUS,SIG_DFL);
+  }
+}
+
+void static throwBusError(uint32_t aAddr){
+  uhal::exception::UIOBusError * e = new uhal::exception::UIOBusError();
+  char error_message[] = "Reg: 0x00000000";
+  snprintf(error_message,sizeof(error_message),"Reg: 0x%08X",aAddr);
+  e->append(error_message);
+  throw *e;
+}
+
+uint32_t static faultingAddress(sUIOAddrEntry const & dev, uint32_t aAddr){
+  uint32_t volatile * fault = (uint32_t volatile *) busError.addr;
+  if((fault >= dev.hw) && (fault < (dev.hw + dev.size))){
+    return dev.uhalAddr + uint32_t(fault - dev.hw);
+  }
+  return aAddr;
+}
+
+//Word by word copies between the mapped memory and a local buffer for the block transfers.
+//Endpoints that can take wide beats use burstRead/burstWrite (ProtocolUIO_burst.cpp) instead.
+//These are specialised on the block mode so the FIFO (NON_INCREMENTAL) loops, which hit the same
+//register for every word, have no mode check left in them.
+template<uhal::defs::BlockReadWriteMode MODE>
+void static readWords(uint32_t volatile const * aSrc, uint32_t * aDst, size_t aCount);
+template<uhal::defs::BlockReadWriteMode MODE>
+void static writeWords(uint32_t volatile * aDst, uint32_t const * aSrc, size_t aCount);
+
+template<>
+void readWords<uhal::defs::INCREMENTAL>(uint32_t volatile const * aSrc, uint32_t * aDst, size_t aCount){
+  for (size_t i = 0; i < aCount; i++) {
+    aDst[i] = aSrc[i];
+  }
+}
+
+template<>
+void readWords<uhal::defs::NON_INCREMENTAL>(uint32_t volatile const * aSrc, uint32_t * aDst, size_t aCount){
+  for (size_t i = 0; i < aCount; i++) {
+    aDst[i] = *aSrc;
+  }
+}
+
+template<>
+void writeWords<uhal::defs::INCREMENTAL>(uint32_t volatile * aDst, uint32_t const * aSrc, size_t aCount){
+  for (size_t i = 0; i < aCount; i++) {
+    aDst[i] = aSrc[i];
+  }
+}
+
+template<>
+void writeWords<uhal::defs::NON_INCREMENTAL>(uint32_t volatile * aDst, uint32_t const * aSrc, size_t aCount){
+  for (size_t i = 0; i < aCount; i++) {
+    *aDst = aSrc[i];
+  }
+}
+
+//FIFO read that checks a status register before every word and stops once (status & aEmptyMask) is set
+size_t static readFIFOWords(uint32_t volatile const * aSrc, uint32_t * aDst, size_t aCount,
+			    uint32_t volatile const * aStatus, uint32_t aEmptyMask){
+  size_t i = 0;
+  for (; i < aCount; i++) {
+    if (*aStatus & aEmptyMask) {
+      break;
+    }
+    aDst[i] = *aSrc;
+  }
+  return i;
+}
+
+//Spin-wait hint so a polling core doesn't starve its sibling or flood the bus with speculative loads
+static inline void cpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile("yield");
+#endif
+}
+
+//Poll aReg until (value & aMask) == aValue or aDeadline passes. aRead gets the last value, aPolls counts the reads
+bool static spinOnRegister(uint32_t volatile const * aReg, uint32_t aMask, uint32_t aValue,
+			   std::chrono::steady_clock::time_point aDeadline, uint32_t & aRead, uint32_t & aPolls){
+  for (;;) {
+    aRead = *aReg;
+    aPolls++;
+    if ((aRead & aMask) == aValue) {
+      return true;
+    }
+    if (std::chrono::steady_clock::now() >= aDeadline) {
+      return false;
+    }
+    cpuRelax();
   }
 }
 
 namespace uhal {  
 
   void UIO::SetupSignalHandler(){
-    //this is here so the signal_handler can stay static
-    memset(&saBusError,0,sizeof(saBusError)); //Clear struct
-    saBusError.sa_handler = signal_handler; //assign signal handler
-    sigemptyset(&saBusError.sa_mask);
-    sigaction(SIGBUS, &saBusError,&saBusError_old);  //install new signal handler (save the old one)
+    std::lock_guard<std::mutex> lock(busErrorHandlerMutex);
+    if(0 == busErrorHandlerUsers++){
+      //this is here so the signal_handler can stay static
+      struct sigaction saBusError;
+      memset(&saBusError,0,sizeof(saBusError)); //Clear struct
+      saBusError.sa_sigaction = signal_handler; //assign signal handler
+      saBusError.sa_flags = SA_SIGINFO; //so the handler gets the faulting address
+      sigemptyset(&saBusError.sa_mask);
+      sigaction(SIGBUS, &saBusError,&saBusError_old);  //install new signal handler (save the old one)
+    }
   }
   void UIO::RemoveSignalHandler(){    
-    sigaction(SIGBUS,&saBusError_old,NULL); //restore the signal handler from before creation for SIGBUS
+    std::lock_guard<std::mutex> lock(busErrorHandlerMutex);
+    if(0 == --busErrorHandlerUsers){
+      sigaction(SIGBUS,&saBusError_old,NULL); //restore the signal handler from before the first UIO for SIGBUS
+    }
+  }
+
+  sUIOAddrEntry const & UIO::lookupAddr(uint32_t aAddr, uint32_t aCount) {
+    //Branch-free search for the last entry whose base address is <= aAddr.
+    //The ternary compiles to a conditional move, so the loop only depends on the table size
+    uint32_t const * base = &addrTableBase[0];
+    size_t count = addrTableBase.size();
+    while (count > 1) {
+      size_t half = count/2;
+      base = (base[half] <= aAddr) ? base + half : base;
+      count -= half;
+    }
+    sUIOAddrEntry const & entry = addrTable[base - &addrTableBase[0]];
+
+    //An address below the first device wraps around and fails this check too.
+    //(acquire: pairs with lookupUnmapped, so hw is set once the size says the address is in range)
+    uint32_t offset = aAddr - entry.uhalAddr;
+    uint32_t size = entry.size.load(std::memory_order_acquire);
+    if ((offset >= size) || (aCount > (size - offset))){
+      //out of range, or not mapped yet
+      return lookupUnmapped(base - &addrTableBase[0], aAddr, aCount);
+    }
+    return entry;
+  }
+
+  sUIOAddrEntry const & UIO::lookupUnmapped(size_t aEntry, uint32_t aAddr, uint32_t aCount) {
+    sUIOAddrEntry & entry = addrTable[aEntry];
+    if (lazy && (aAddr >= entry.uhalAddr)) {
+      //threads that get here at the same time map the endpoint once
+      std::lock_guard<std::mutex> lock(deviceMutex);
+      if (NULL == entry.hw) {
+	sUIODevice & dev = *(entry.dev);
+	if (dev.uioName.empty()) {
+	  //first use of this endpoint: find it like the constructor would have
+	  if (!discoveryIndexBuilt) {
+	    buildDiscoveryIndex();
+	  }
+	  resolveDevice(dev);
+	}
+	//(an endpoint that fails to map stays unmapped and is tried again on its next access)
+	mapDevice(dev);
+	//lookupAddr only reads hw once size says the address is in range, and doesn't lock
+	entry.hw = dev.hw;
+	entry.size.store(dev.size, std::memory_order_release);
+	log (Debug(), "Lazily mapped ", dev.hwNodeName.c_str());
+      }
+      //check the range again now that the size is known
+      uint32_t offset = aAddr - entry.uhalAddr;
+      uint32_t size = entry.size.load(std::memory_order_relaxed); //(stored by this thread or under deviceMutex)
+      if ((offset < size) && (aCount <= (size - offset))) {
+	return entry;
+      }
+    }
+
+    //offset (or the end of the transfer) is ouside of mapped range
+    uhal::exception::UIODevOOR * lExc = new uhal::exception::UIODevOOR();
+    log (*lExc, "Address (",
+	 Integer(aAddr,IntFmt<hex,fixed>()),
+	 ") with size ",
+	 Integer(aCount),
+	 " out of mapped range: ",
+	 Integer(entry.uhalAddr,IntFmt<hex,fixed>()),
+	 " to ",
+	 Integer(entry.uhalAddr+entry.size,IntFmt<hex,fixed>())
+	 );
+    throw *lExc;
+  }
+
+  uint32_t UIO::getRegisterFlags(sUIOAddrEntry const & aDev, uint32_t aAddr) const {
+    uint32_t flags = aDev.flags;
+    if (!registerFlags.empty()) {
+      std::unordered_map<uint32_t,uint32_t>::const_iterator itFlags = registerFlags.find(aAddr);
+      if (itFlags != registerFlags.end()) {
+	flags |= itFlags->second;
+      }
+    }
+    return flags;
   }
 
   ValHeader UIO::implementWrite (const uint32_t& aAddr, const uint32_t& aValue) {
 
     //Get the device
-    sUIODevice const & dev = (--(devices.upper_bound(aAddr)))->second;
-
+    sUIOAddrEntry const & dev = lookupAddr(aAddr);
     uint32_t offset = aAddr-dev.uhalAddr;
-    if (offset >= dev.size){
-      //offset is ouside of mapped range
-      uhal::exception::UIODevOOR * lExc = new uhal::exception::UIODevOOR();
-      log (*lExc, "Address (",
-	   Integer(aAddr,IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw *lExc;
+
+    if (deferred) {
+      sUIOThreadState & state = threadState();
+      sUIOTransaction & tx = queueTransaction(state, sUIOTransaction::WRITE, dev, aAddr);
+      tx.termA = aValue;
+      tx.index = state.valheaders.size();
+      state.valheaders.push_back(ValHeader());
+      return state.valheaders.back();
     }
     
-    
     BUS_ERROR_PROTECTION(dev.hw[offset] = aValue,aAddr);
     return ValHeader();
   }
@@ -151,99 +451,113 @@ namespace uhal {
 				      const std::vector<uint32_t>& aValues,
 				      const defs::BlockReadWriteMode& aMode) {
     //Get the device
-    sUIODevice const & dev = (--(devices.upper_bound(aAddr)))->second;
-
+    sUIOAddrEntry const & dev = lookupAddr(aAddr, (aMode == defs::INCREMENTAL) ? aValues.size() : 1);
     uint32_t offset = aAddr-dev.uhalAddr;
-    if (offset >= dev.size){
-      //offset is ouside of mapped range
-      uhal::exception::UIODevOOR* lExc = new uhal::exception::UIODevOOR();
-      log (*lExc, "Address (",
-	   Integer(aAddr,IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw *lExc;
-    }
-    if ((offset+ aValues.size()) >= dev.size){
-      //offset + size is ouside of mapped range
-      uhal::exception::UIODevOOR* lExc = new uhal::exception::UIODevOOR();
-      log (*lExc, "Address (",
-	   Integer(aAddr+aValues.size(),IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw *lExc;
-    }
-
-    std::vector<uint32_t>::const_iterator ptr;
-    for (ptr = aValues.begin(); ptr < aValues.end(); ptr++) {
-      BUS_ERROR_PROTECTION(dev.hw[offset] = *ptr,aAddr)
-      if ( aMode == defs::INCREMENTAL ) {
-        offset ++;
-      }
+
+    if (deferred) {
+      sUIOThreadState & state = threadState();
+      sUIOTransaction & tx = queueTransaction(state, (aMode == defs::INCREMENTAL) ? sUIOTransaction::WRITE_BLOCK : sUIOTransaction::WRITE_FIFO,
+					      dev, aAddr);
+      tx.count = aValues.size();
+      tx.termA = state.transactionData.size();
+      state.transactionData.insert(state.transactionData.end(), aValues.begin(), aValues.end());
+      tx.index = state.valheaders.size();
+      state.valheaders.push_back(ValHeader());
+      return state.valheaders.back();
+    }
+
+    if (aMode != defs::INCREMENTAL) {
+      BUS_ERROR_PROTECTION_BLOCK(writeWords<defs::NON_INCREMENTAL>(dev.hw+offset, aValues.data(), aValues.size()),dev,aAddr)
+    } else if (dev.burstWidth > 32) {
+      BUS_ERROR_PROTECTION_BLOCK(burstWrite(dev.hw+offset, aValues.data(), aValues.size(), dev.burstWidth),dev,aAddr)
+    } else {
+      BUS_ERROR_PROTECTION_BLOCK(writeWords<defs::INCREMENTAL>(dev.hw+offset, aValues.data(), aValues.size()),dev,aAddr)
     }
     return ValHeader();
   }
 
   ValWord<uint32_t> UIO::implementRead (const uint32_t& aAddr, const uint32_t& aMask) {
     //Get the device
-    sUIODevice const & dev = (--(devices.upper_bound(aAddr)))->second;
-
+    sUIOAddrEntry const & dev = lookupAddr(aAddr);
     uint32_t offset = aAddr-dev.uhalAddr;
-    if (offset >= dev.size){
-      //offset is ouside of mapped range
-      uhal::exception::UIODevOOR* lExc = new uhal::exception::UIODevOOR();
-      log (*lExc, "Address (",
-	   Integer(aAddr,IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw *lExc;
+
+    sUIOThreadState & state = threadState();
+    if (deferred) {
+      sUIOTransaction & tx = queueTransaction(state, sUIOTransaction::READ, dev, aAddr);
+      tx.index = state.valwords.size();
+      state.valwords.push_back(ValWord<uint32_t>(0, aMask));
+      return state.valwords.back();
     }
 
     uint32_t readval;
     BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
     ValWord<uint32_t> vw(readval, aMask);
-    valwords.push_back(vw);
+    state.valwords.push_back(vw);
     primeDispatch();
     return vw;
   }
     
   ValVector< uint32_t > UIO::implementReadBlock (const uint32_t& aAddr, const uint32_t& aSize, const defs::BlockReadWriteMode& aMode) {
-    //Get the device
-    sUIODevice const & dev = (--(devices.upper_bound(aAddr)))->second;
+    sUIOThreadState & state = threadState();
+    if (deferred) {
+      //Get the device
+      sUIOAddrEntry const & dev = lookupAddr(aAddr, (aMode == defs::INCREMENTAL) ? aSize : 1);
+      sUIOTransaction & tx = queueTransaction(state, (aMode == defs::INCREMENTAL) ? sUIOTransaction::READ_BLOCK : sUIOTransaction::READ_FIFO,
+					      dev, aAddr);
+      tx.count = aSize;
+      tx.termA = state.transactionData.size();
+      state.transactionData.resize(state.transactionData.size() + aSize);
+      tx.index = state.valvectors.size();
+      state.valvectors.push_back(ValVector<uint32_t>());
+      return state.valvectors.back();
+    }
+
+    std::vector<uint32_t> read_vector(aSize);
+    readBlockInto(aAddr, read_vector.data(), aSize, aMode);
+    state.valvectors.push_back(ValVector< uint32_t> (read_vector));
+    primeDispatch();
+    return state.valvectors.back();
+  }
 
+  void UIO::readBlockInto (const uint32_t& aAddr, uint32_t * aBuffer, const uint32_t& aSize, const defs::BlockReadWriteMode& aMode) {
+    //Get the device
+    sUIOAddrEntry const & dev = lookupAddr(aAddr, (aMode == defs::INCREMENTAL) ? aSize : 1);
     uint32_t offset = aAddr-dev.uhalAddr;
-    if (offset >= dev.size){
-      //offset is ouside of mapped range
-      uhal::exception::UIODevOOR* lExc = new uhal::exception::UIODevOOR();
-      log (*lExc, "Address (",
-	   Integer(aAddr,IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw *lExc;
+
+    //keep program order with anything still queued
+    executeTransactions();
+
+    if (aMode != defs::INCREMENTAL) {
+      BUS_ERROR_PROTECTION_BLOCK(readWords<defs::NON_INCREMENTAL>(dev.hw+offset, aBuffer, aSize),dev,aAddr)
+    } else if (dev.burstWidth > 32) {
+      BUS_ERROR_PROTECTION_BLOCK(burstRead(dev.hw+offset, aBuffer, aSize, dev.burstWidth),dev,aAddr)
+    } else {
+      BUS_ERROR_PROTECTION_BLOCK(readWords<defs::INCREMENTAL>(dev.hw+offset, aBuffer, aSize),dev,aAddr)
     }
+  }
 
-    std::vector<uint32_t> read_vector(aSize);
-    std::vector<uint32_t>::iterator ptr;
-    for (ptr = read_vector.begin(); ptr < read_vector.end(); ptr++) {
-      uint32_t readval;
-      BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
-      *ptr = readval;
-      if ( aMode == defs::INCREMENTAL ) {
-	      offset ++;
-      }
+  uint32_t UIO::readFIFO (const uint32_t& aAddr, uint32_t * aBuffer, const uint32_t& aSize,
+			  const uint32_t& aEmptyAddr, const uint32_t& aEmptyMask) {
+    //Get the device
+    sUIOAddrEntry const & dev = lookupAddr(aAddr);
+    uint32_t offset = aAddr-dev.uhalAddr;
+
+    //keep program order with anything still queued
+    executeTransactions();
+
+    if (0 == aEmptyMask) {
+      BUS_ERROR_PROTECTION_BLOCK(readWords<defs::NON_INCREMENTAL>(dev.hw+offset, aBuffer, aSize),dev,aAddr)
+      return aSize;
     }
-    return ValVector< uint32_t> (read_vector);
+
+    //The status register can live in another endpoint
+    sUIOAddrEntry const & statusDev = lookupAddr(aEmptyAddr);
+    uint32_t statusOffset = aEmptyAddr-statusDev.uhalAddr;
+    size_t readCount = 0;
+    //(a fault outside the FIFO's endpoint is looked for in the status register's)
+    BUS_ERROR_PROTECTION_BLOCK(readCount = readFIFOWords(dev.hw+offset, aBuffer, aSize, statusDev.hw+statusOffset, aEmptyMask),
+			       dev,faultingAddress(statusDev,aAddr))
+    return readCount;
   }
 
   void UIO::primeDispatch () {
@@ -254,74 +568,504 @@ namespace uhal {
     checkBufferSpace ( sendcount, replycount, sendavail, replyavail);
   }
 
+  sUIOTransaction & UIO::queueTransaction(sUIOThreadState & state, sUIOTransaction::eType aType, sUIOAddrEntry const & aDev, uint32_t aAddr) {
+    sUIOTransaction tx;
+    tx.type  = aType;
+    tx.addr  = aAddr;
+    tx.count = 1;
+    tx.termA = 0;
+    tx.termB = 0;
+    tx.index = 0;
+    tx.dev   = &aDev;
+    state.transactions.push_back(tx);
+    primeDispatch();
+    return state.transactions.back();
+  }
+
+  void UIO::coalesceTransactions(sUIOThreadState & state) {
+    //Replace runs of single reads of neighbouring registers in the same device by one READ_RUN.
+    //Only state.transactions that are next to each other in the queue are merged, so the order of
+    //accesses on the bus doesn't change.
+    //Reads in a run pushed their ValWords one after the other, so their results are contiguous too.
+    size_t out = 0;
+    for (size_t in = 0; in < state.transactions.size(); ) {
+      sUIOTransaction tx = state.transactions[in];
+      size_t run = 1;
+      if (sUIOTransaction::READ == tx.type) {
+	while (((in + run) < state.transactions.size()) &&
+	       (sUIOTransaction::READ == state.transactions[in+run].type) &&
+	       (tx.dev == state.transactions[in+run].dev) &&
+	       ((tx.addr + run) == state.transactions[in+run].addr)) {
+	  run++;
+	}
+	if (run > 1) {
+	  tx.type  = sUIOTransaction::READ_RUN;
+	  tx.count = run;
+	  tx.termA = state.transactionData.size();
+	  state.transactionData.resize(state.transactionData.size() + run);
+	  state.dispatchStats.coalescedRuns++;
+	  state.dispatchStats.coalescedReads += run;
+	}
+      }
+      state.transactions[out++] = tx;
+      in += run;
+    }
+    state.transactions.resize(out);
+  }
+
+  void UIO::combineTransactions(sUIOThreadState & state) {
+    //Works on runs of single writes with nothing else queued in between.  Inside a run:
+    // - a write is dropped (squashed) if a later write in the run goes to the same register
+    // - writes to neighbouring registers of the same device are merged into one WRITE_BLOCK
+    //Writes to REG_SIDE_EFFECT registers are never dropped or merged, and nothing is squashed
+    //across them, so everything keeps its order relative to FIFO ports and strobes.
+    //The ValHeaders of dropped and merged writes are still validated by the dispatch.
+    std::vector<sUIOTransaction> combined;
+    combined.reserve(state.transactions.size());
+    std::vector<bool> keep;
+    std::unordered_set<uint32_t> writtenLater;
+    for (size_t start = 0; start < state.transactions.size(); ) {
+      if (sUIOTransaction::WRITE != state.transactions[start].type) {
+	combined.push_back(state.transactions[start++]);
+	continue;
+      }
+      size_t end = start;
+      while ((end < state.transactions.size()) && (sUIOTransaction::WRITE == state.transactions[end].type)) {
+	end++;
+      }
+
+      //squash, walking the run backwards
+      keep.assign(end - start, true);
+      writtenLater.clear();
+      for (size_t iTx = end; iTx-- > start; ) {
+	if (getRegisterFlags(*(state.transactions[iTx].dev), state.transactions[iTx].addr) & REG_SIDE_EFFECT) {
+	  writtenLater.clear();
+	} else if (!writtenLater.insert(state.transactions[iTx].addr).second) {
+	  keep[iTx - start] = false;
+	  state.dispatchStats.squashedWrites++;
+	}
+      }
+
+      //merge what is left
+      size_t iTx = start;
+      while (iTx < end) {
+	if (!keep[iTx - start]) {
+	  iTx++;
+	  continue;
+	}
+	sUIOTransaction tx = state.transactions[iTx++];
+	if (getRegisterFlags(*(tx.dev), tx.addr) & REG_SIDE_EFFECT) {
+	  combined.push_back(tx);
+	  continue;
+	}
+	size_t dataStart = state.transactionData.size();
+	state.transactionData.push_back(tx.termA);
+	while (iTx < end) {
+	  if (!keep[iTx - start]) {
+	    iTx++;
+	    continue;
+	  }
+	  sUIOTransaction const & next = state.transactions[iTx];
+	  if ((next.dev != tx.dev) ||
+	      (next.addr != (tx.addr + (state.transactionData.size() - dataStart))) ||
+	      (getRegisterFlags(*(next.dev), next.addr) & REG_SIDE_EFFECT)) {
+	    break;
+	  }
+	  state.transactionData.push_back(next.termA);
+	  iTx++;
+	}
+	if ((state.transactionData.size() - dataStart) > 1) {
+	  tx.type  = sUIOTransaction::WRITE_BLOCK;
+	  tx.count = state.transactionData.size() - dataStart;
+	  tx.termA = dataStart;
+	  state.dispatchStats.combinedRuns++;
+	  state.dispatchStats.combinedWrites += tx.count;
+	} else {
+	  state.transactionData.pop_back();
+	}
+	combined.push_back(tx);
+      }
+      start = end;
+    }
+    state.transactions.swap(combined);
+  }
+
+  void UIO::runTransactions(sUIOThreadState & state) {
+    //This runs inside a single BUS_ERROR_PROTECTION_BLOCK and a fault leaves it with siglongjmp,
+    //so it must not have any locals with destructors, and the RMW lock is taken by hand
+    //(busError.heldLock tells executeTransactions to release it after a fault).
+    for (size_t iTx = 0; iTx < state.transactions.size(); iTx++) {
+      state.transactionCurrent = iTx;
+      sUIOTransaction const & tx = state.transactions[iTx];
+      uint32_t volatile * reg = tx.dev->hw + (tx.addr - tx.dev->uhalAddr);
+      uint32_t readval;
+      std::mutex * rmwLock;
+      switch (tx.type) {
+      case sUIOTransaction::WRITE:
+	*reg = tx.termA;
+	break;
+      case sUIOTransaction::READ:
+	readval = *reg;
+	state.valwords[tx.index].value(readval);
+	break;
+      case sUIOTransaction::RMW_BITS:
+	rmwLock = tx.dev->dev->mapping->rmwLock.get();
+	rmwLock->lock();
+	busError.heldLock = rmwLock;
+	readval = *reg;
+	readval &= tx.termA;
+	readval |= tx.termB;
+	*reg = readval;
+	if (tx.count) {
+	  readval = *reg;
+	}
+	busError.heldLock = NULL;
+	rmwLock->unlock();
+	state.valwords[tx.index].value(readval);
+	break;
+      case sUIOTransaction::RMW_SUM:
+	rmwLock = tx.dev->dev->mapping->rmwLock.get();
+	rmwLock->lock();
+	busError.heldLock = rmwLock;
+	readval = *reg;
+	readval += tx.termA;
+	*reg = readval;
+	if (tx.count) {
+	  readval = *reg;
+	}
+	busError.heldLock = NULL;
+	rmwLock->unlock();
+	state.valwords[tx.index].value(readval);
+	break;
+      case sUIOTransaction::WRITE_BLOCK:
+	if (tx.dev->burstWidth > 32) {
+	  burstWrite(reg, state.transactionData.data() + tx.termA, tx.count, tx.dev->burstWidth);
+	} else {
+	  writeWords<defs::INCREMENTAL>(reg, state.transactionData.data() + tx.termA, tx.count);
+	}
+	break;
+      case sUIOTransaction::WRITE_FIFO:
+	writeWords<defs::NON_INCREMENTAL>(reg, state.transactionData.data() + tx.termA, tx.count);
+	break;
+      case sUIOTransaction::READ_BLOCK:
+	if (tx.dev->burstWidth > 32) {
+	  burstRead(reg, state.transactionData.data() + tx.termA, tx.count, tx.dev->burstWidth);
+	} else {
+	  readWords<defs::INCREMENTAL>(reg, state.transactionData.data() + tx.termA, tx.count);
+	}
+	state.valvectors[tx.index].assign(state.transactionData.begin() + tx.termA, state.transactionData.begin() + tx.termA + tx.count);
+	break;
+      case sUIOTransaction::READ_FIFO:
+	readWords<defs::NON_INCREMENTAL>(reg, state.transactionData.data() + tx.termA, tx.count);
+	state.valvectors[tx.index].assign(state.transactionData.begin() + tx.termA, state.transactionData.begin() + tx.termA + tx.count);
+	break;
+      case sUIOTransaction::READ_RUN:
+	if (tx.dev->burstWidth > 32) {
+	  burstRead(reg, state.transactionData.data() + tx.termA, tx.count, tx.dev->burstWidth);
+	} else {
+	  readWords<defs::INCREMENTAL>(reg, state.transactionData.data() + tx.termA, tx.count);
+	}
+	for (uint32_t iWord = 0; iWord < tx.count; iWord++) {
+	  state.valwords[tx.index + iWord].value(state.transactionData[tx.termA + iWord]);
+	}
+	break;
+      }
+    }
+  }
+
+  void UIO::executeTransactions() {
+    sUIOThreadState & state = threadState();
+    std::lock_guard<std::mutex> lock(state.lock);
+    executeTransactions(state);
+  }
+
+  void UIO::executeTransactions(sUIOThreadState & state) {
+    if (state.transactions.empty()) {
+      return;
+    }
+
+    if (combineWrites) {
+      combineTransactions(state);
+    }
+    if (coalesceReads) {
+      coalesceTransactions(state);
+    }
+
+    try {
+      BUS_ERROR_PROTECTION_BLOCK(runTransactions(state),
+				 *(state.transactions[state.transactionCurrent].dev),
+				 state.transactions[state.transactionCurrent].addr)
+    } catch (...) {
+      //Whatever didn't run is dropped and nothing queued so far will be validated
+      busError.armed = 0;
+      if (NULL != busError.heldLock) {
+	busError.heldLock->unlock();
+	busError.heldLock = NULL;
+      }
+      state.transactions.clear();
+      state.transactionData.clear();
+      state.valwords.clear();
+      state.valvectors.clear();
+      state.valheaders.clear();
+      throw;
+    }
+    state.transactions.clear();
+    state.transactionData.clear();
+    //One barrier for the whole pass so every write has gone out before dispatch returns
+    __sync_synchronize();
+  }
+
 #if UHAL_VER_MAJOR >= 2 && UHAL_VER_MINOR >= 8
   void UIO::implementDispatch (std::shared_ptr<Buffers> /*aBuffers*/) {
 #else
   void UIO::implementDispatch (boost::shared_ptr<Buffers> /*aBuffers*/) {
 #endif
     log ( Debug(), "UIO: Dispatch");
-    for (unsigned int i=0; i<valwords.size(); i++)
-      valwords[i].valid(true);
-    valwords.clear();
+    //uHAL dispatches for the whole client, so this completes what every thread has pending,
+    //each thread's queue in its own order.  The states are copied first, so that the queues only
+    //run under their own locks and threads can come and go meanwhile
+    std::vector< std::shared_ptr<sUIOThreadState> > states;
+    {
+      std::lock_guard<std::mutex> lockStates(threadStates->mutex);
+      states = threadStates->states;
+    }
+    for (size_t iState = 0; iState < states.size(); iState++) {
+      sUIOThreadState & state = *states[iState];
+      std::unique_lock<std::mutex> lock(state.lock);
+
+      //In deferred mode this is where the accesses actually happen
+      executeTransactions(state);
+
+      for (unsigned int i=0; i<state.valwords.size(); i++)
+	state.valwords[i].valid(true);
+      state.valwords.clear();
+      for (unsigned int i=0; i<state.valvectors.size(); i++)
+	state.valvectors[i].valid(true);
+      state.valvectors.clear();
+      for (unsigned int i=0; i<state.valheaders.size(); i++)
+	state.valheaders[i].valid(true);
+      state.valheaders.clear();
+
+      //the last of the accesses of a thread that has exited
+      if (state.orphaned) {
+	lock.unlock();
+	dropThreadState(*threadStates, &state);
+      }
+    }
+  }
+
+  sUIOThreadState & UIO::threadState() {
+    //most threads stick to one client, so the last one used is remembered without any locking
+    if (threadStateCache.client == clientId) {
+      return *threadStateCache.state;
+    }
+    std::vector<sThreadStateOwner::sOwned> & owned = threadStateOwner.owned;
+    sUIOThreadState * state = NULL;
+    for (size_t iOwned = 0; iOwned < owned.size(); ) {
+      if (owned[iOwned].states.expired()) {
+	owned.erase(owned.begin() + iOwned); //of a client that has gone
+      } else {
+	if (owned[iOwned].client == clientId) {
+	  state = owned[iOwned].state;
+	}
+	iOwned++;
+      }
+    }
+    if (NULL == state) {
+      std::shared_ptr<sUIOThreadState> newState = std::make_shared<sUIOThreadState>();
+      {
+	std::lock_guard<std::mutex> lock(threadStates->mutex);
+	threadStates->states.push_back(newState);
+      }
+      sThreadStateOwner::sOwned newOwned = {clientId, threadStates, newState.get()};
+      owned.push_back(newOwned);
+      state = newState.get();
+    }
+    threadStateCache.client = clientId;
+    threadStateCache.state = state;
+    return *state;
+  }
+
+  sUIODispatchStats UIO::getDispatchStats() const {
+    std::lock_guard<std::mutex> lockStates(threadStates->mutex);
+    sUIODispatchStats total = threadStates->droppedStats;
+    for (auto itState = threadStates->states.begin(); itState != threadStates->states.end(); itState++) {
+      std::lock_guard<std::mutex> lock((*itState)->lock);
+      sUIODispatchStats const & stats = (*itState)->dispatchStats;
+      total.coalescedRuns  += stats.coalescedRuns;
+      total.coalescedReads += stats.coalescedReads;
+      total.squashedWrites += stats.squashedWrites;
+      total.combinedRuns   += stats.combinedRuns;
+      total.combinedWrites += stats.combinedWrites;
+    }
+    return total;
+  }
+
+  void UIO::resetDispatchStats() {
+    std::lock_guard<std::mutex> lockStates(threadStates->mutex);
+    threadStates->droppedStats = sUIODispatchStats();
+    for (auto itState = threadStates->states.begin(); itState != threadStates->states.end(); itState++) {
+      std::lock_guard<std::mutex> lock((*itState)->lock);
+      (*itState)->dispatchStats = sUIODispatchStats();
+    }
   }
 
   ValWord<uint32_t> UIO::implementRMWbits (const uint32_t& aAddr , const uint32_t& aANDterm , const uint32_t& aORterm) {
     //Get the device
-    sUIODevice const & dev = (--(devices.upper_bound(aAddr)))->second;
-
+    sUIOAddrEntry const & dev = lookupAddr(aAddr);
     uint32_t offset = aAddr-dev.uhalAddr;
-    if (offset >= dev.size){
-      //offset is ouside of mapped range
-      uhal::exception::UIODevOOR* lExc = new uhal::exception::UIODevOOR();
-      log (*lExc, "Address (",
-	   Integer(aAddr,IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw *lExc;
+
+    //The final read back can be turned off per client or per register
+    bool readBack = rmwReadBack && !(getRegisterFlags(dev, aAddr) & REG_NO_READBACK);
+
+    if (deferred) {
+      sUIOThreadState & state = threadState();
+      sUIOTransaction & tx = queueTransaction(state, sUIOTransaction::RMW_BITS, dev, aAddr);
+      tx.termA = aANDterm;
+      tx.termB = aORterm;
+      tx.count = readBack ? 1 : 0;
+      tx.index = state.valwords.size();
+      state.valwords.push_back(ValWord<uint32_t>(0));
+      return state.valwords.back();
     }
     
-    //read the current value
-    uint32_t readval;
-    BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
+    //read the current value (no other RMW of the mapping, from any thread or client, in between)
+    uint32_t volatile readval; //(volatile: it is live across the sigsetjmps of BUS_ERROR_PROTECTION)
+    {
+      std::lock_guard<std::mutex> lock(*(dev.dev->mapping->rmwLock));
+      BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
 
-    //apply and and or operations
-    readval &= aANDterm;
-    readval |= aORterm;
-    BUS_ERROR_PROTECTION(dev.hw[offset] = readval,aAddr)
-    BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
-    return ValWord<uint32_t>(readval);
+      //apply and and or operations
+      readval &= aANDterm;
+      readval |= aORterm;
+      BUS_ERROR_PROTECTION(dev.hw[offset] = readval,aAddr)
+      if (readBack) {
+	BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
+      }
+    }
+    sUIOThreadState & state = threadState();
+    state.valwords.push_back(ValWord<uint32_t>(uint32_t(readval)));
+    primeDispatch();
+    return state.valwords.back();
   }
 
 
   ValWord<uint32_t> UIO::implementRMWsum (const uint32_t& aAddr, const int32_t& aAddend) {
     //Get the device
-    sUIODevice const & dev = (--(devices.upper_bound(aAddr)))->second;
+    sUIOAddrEntry const & dev = lookupAddr(aAddr);
+    uint32_t offset = aAddr-dev.uhalAddr;
+
+    //The final read back can be turned off per client or per register
+    bool readBack = rmwReadBack && !(getRegisterFlags(dev, aAddr) & REG_NO_READBACK);
+
+    if (deferred) {
+      sUIOThreadState & state = threadState();
+      sUIOTransaction & tx = queueTransaction(state, sUIOTransaction::RMW_SUM, dev, aAddr);
+      tx.termA = aAddend;
+      tx.count = readBack ? 1 : 0;
+      tx.index = state.valwords.size();
+      state.valwords.push_back(ValWord<uint32_t>(0));
+      return state.valwords.back();
+    }
+
+    //read the current value (no other RMW of the mapping, from any thread or client, in between)
+    uint32_t volatile readval; //(volatile: it is live across the sigsetjmps of BUS_ERROR_PROTECTION)
+    {
+      std::lock_guard<std::mutex> lock(*(dev.dev->mapping->rmwLock));
+      BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
+      //apply and and or operations
+      readval += aAddend;
+      BUS_ERROR_PROTECTION(dev.hw[offset] = readval,aAddr)
+      if (readBack) {
+	BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
+      }
+    }
+    sUIOThreadState & state = threadState();
+    state.valwords.push_back(ValWord<uint32_t>(uint32_t(readval)));
+    primeDispatch();
+    return state.valwords.back();
+  }
 
+  uint32_t UIO::rmwBits (const uint32_t& aAddr, const std::vector< std::pair<uint32_t,uint32_t> >& aTerms) {
+    //Get the device
+    sUIOAddrEntry const & dev = lookupAddr(aAddr);
     uint32_t offset = aAddr-dev.uhalAddr;
-    if (offset >= dev.size){
-      //offset is ouside of mapped range
-      uhal::exception::UIODevOOR* lExc = new uhal::exception::UIODevOOR();
-      log (*lExc, "Address (",
-	   Integer(aAddr,IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw *lExc;
-    }
-
-    //read the current value
-    uint32_t readval;
+
+    //((v & a0) | o0) & a1 | o1 == (v & (a0 & a1)) | ((o0 & a1) | o1), so the whole list folds
+    //into one AND and one OR term
+    uint32_t andTerm = 0xFFFFFFFF;
+    uint32_t orTerm  = 0;
+    for (size_t iTerm = 0; iTerm < aTerms.size(); iTerm++) {
+      andTerm &= aTerms[iTerm].first;
+      orTerm   = (orTerm & aTerms[iTerm].first) | aTerms[iTerm].second;
+    }
+
+    //keep program order with anything still queued
+    executeTransactions();
+
+    uint32_t volatile readval; //(volatile: it is live across the sigsetjmps of BUS_ERROR_PROTECTION)
+    std::lock_guard<std::mutex> lock(*(dev.dev->mapping->rmwLock));
     BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
-    //apply and and or operations
-    readval += aAddend;
+    readval = (readval & andTerm) | orTerm;
     BUS_ERROR_PROTECTION(dev.hw[offset] = readval,aAddr)
-    BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
-    return ValWord<uint32_t>(readval);
+    return readval;
+  }
+
+  sUIOWaitResult UIO::waitFor (const uint32_t& aAddr, const uint32_t& aMask, const uint32_t& aValue,
+			       const uint32_t& aTimeout) {
+    //Get the device
+    sUIOAddrEntry const & dev = lookupAddr(aAddr);
+    uint32_t volatile const * reg = dev.hw + (aAddr-dev.uhalAddr);
+    bool useIRQ = getRegisterFlags(dev, aAddr) & REG_IRQ;
+    uint32_t expected = aValue & aMask;
+
+    //keep program order with anything still queued (e.g. the write that starts what is waited for)
+    executeTransactions();
+
+    sUIOWaitResult result;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point deadline = start + std::chrono::milliseconds(aTimeout ? aTimeout : getTimeoutPeriod());
+    std::chrono::steady_clock::time_point spinEnd = std::min(start + std::chrono::microseconds(waitSpin), deadline);
+
+    //Most waits end within a few bus round trips: spin under one fault guard
+    uint32_t readval = 0;
+    uint32_t polls = 0;
+    bool matched = false;
+    BUS_ERROR_PROTECTION(matched = spinOnRegister(reg, aMask, expected, spinEnd, readval, polls),aAddr)
+
+    //Then give the core up between polls
+    std::chrono::microseconds backoff(10);
+    std::chrono::steady_clock::time_point now;
+    while (!matched && ((now = std::chrono::steady_clock::now()) < deadline)) {
+      if (useIRQ) {
+	//arm before the next poll, so a change between the two isn't missed
+	armIRQ(aAddr);
+	BUS_ERROR_PROTECTION(readval = *reg,aAddr)
+	polls++;
+	if ((readval & aMask) == expected) {
+	  matched = true;
+	  break;
+	}
+	uint32_t remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+	try {
+	  waitIRQ(aAddr, remaining);
+	} catch (uhal::exception::UIOIRQTimeout &) {
+	  //the last poll below decides
+	}
+      } else {
+	std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(backoff, deadline - now));
+	backoff = std::min(backoff*2, std::chrono::microseconds(1000));
+      }
+      BUS_ERROR_PROTECTION(readval = *reg,aAddr)
+      polls++;
+      matched = ((readval & aMask) == expected);
+    }
+
+    result.matched = matched;
+    result.value = readval;
+    result.polls = polls;
+    result.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    return result;
   }
 
   exception::exception* UIO::validate (uint8_t* /*aSendBufferStart*/,
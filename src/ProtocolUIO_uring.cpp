@@ -0,0 +1,284 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+
+
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <vector>
+#include <algorithm>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include <ProtocolUIO.hpp>
+
+//io_uring needs kernel 5.6 headers (the opcode probe); older ones build the epoll fallback only
+#if defined(__NR_io_uring_setup) && defined(IO_URING_OP_SUPPORTED)
+#define UIO_HAVE_IO_URING
+#endif
+
+namespace uioaxi {
+
+  sUIORing::sUIORing() :
+    fd(-1),
+    wakeBuffer(0),
+    wakeReading(false),
+    sqRing(MAP_FAILED),
+    sqRingBytes(0),
+    cqRing(MAP_FAILED),
+    cqRingBytes(0),
+    sqes(MAP_FAILED),
+    sqesBytes(0),
+    sqHead(NULL),
+    sqTail(NULL),
+    sqArray(NULL),
+    sqMask(0),
+    sqEntries(0),
+    sqQueued(0),
+    cqHead(NULL),
+    cqTail(NULL),
+    cqMask(0),
+    cqes(NULL){
+    timeout[0] = timeout[1] = 0;
+  }
+
+  sUIORing::~sUIORing()
+  {
+    if(sqes != MAP_FAILED){
+      munmap(sqes, sqesBytes);
+    }
+    if((cqRing != MAP_FAILED) && (cqRing != sqRing)){
+      munmap(cqRing, cqRingBytes);
+    }
+    if(sqRing != MAP_FAILED){
+      munmap(sqRing, sqRingBytes);
+    }
+    if(fd != -1){
+      close(fd);
+    }
+  }
+
+#ifdef UIO_HAVE_IO_URING
+
+  int sUIORing::setup(uint32_t aEntries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, aEntries, &params);
+    if (fd < 0) {
+      fd = -1;
+      return errno;
+    }
+
+    //every opcode used here must be there (a kernel can also have io_uring with some of them filtered out)
+    std::vector<char> probeBuffer(sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op), 0);
+    struct io_uring_probe * probe = (struct io_uring_probe *) probeBuffer.data();
+    if (0 != syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256)) {
+      return errno;
+    }
+    uint8_t const needed[] = {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_TIMEOUT, IORING_OP_TIMEOUT_REMOVE,
+			      IORING_OP_ASYNC_CANCEL};
+    for (size_t iOp = 0; iOp < sizeof(needed); iOp++) {
+      if ((needed[iOp] > probe->last_op) || !(probe->ops[needed[iOp]].flags & IO_URING_OP_SUPPORTED)) {
+	return EOPNOTSUPP;
+      }
+    }
+
+    sqRingBytes = params.sq_off.array + params.sq_entries*sizeof(uint32_t);
+    cqRingBytes = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+    }
+    sqRing = mmap(NULL, sqRingBytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+      return errno;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      cqRing = sqRing;
+    } else {
+      cqRing = mmap(NULL, cqRingBytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (cqRing == MAP_FAILED) {
+	return errno;
+      }
+    }
+    sqesBytes = params.sq_entries*sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqesBytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      return errno;
+    }
+
+    sqHead    = (uint32_t *) ((char *) sqRing + params.sq_off.head);
+    sqTail    = (uint32_t *) ((char *) sqRing + params.sq_off.tail);
+    sqArray   = (uint32_t *) ((char *) sqRing + params.sq_off.array);
+    sqMask    = *(uint32_t *) ((char *) sqRing + params.sq_off.ring_mask);
+    sqEntries = params.sq_entries;
+    cqHead    = (uint32_t *) ((char *) cqRing + params.cq_off.head);
+    cqTail    = (uint32_t *) ((char *) cqRing + params.cq_off.tail);
+    cqMask    = *(uint32_t *) ((char *) cqRing + params.cq_off.ring_mask);
+    cqes      = (char *) cqRing + params.cq_off.cqes;
+    return 0;
+  }
+
+  void * sUIORing::nextSQE(uint32_t aOpcode, int aFd, uint64_t aTag) {
+    //only this thread moves the tail, the kernel moves the head as it takes entries
+    uint32_t tail = *sqTail + sqQueued;
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+      //full: hand what is queued to the kernel to make room
+      if ((submit(0) < 0) || (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)) {
+	return NULL;
+      }
+      tail = *sqTail;
+    }
+    struct io_uring_sqe * sqe = ((struct io_uring_sqe *) sqes) + (tail & sqMask);
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = aOpcode;
+    sqe->fd = aFd;
+    sqe->user_data = aTag;
+    sqArray[tail & sqMask] = tail & sqMask;
+    sqQueued++;
+    return sqe;
+  }
+
+  bool sUIORing::queueRead(int aFd, void * aBuffer, uint32_t aBytes, uint64_t aTag, bool aLinked) {
+    struct io_uring_sqe * sqe = (struct io_uring_sqe *) nextSQE(IORING_OP_READ, aFd, aTag);
+    if (NULL == sqe) {
+      return false;
+    }
+    sqe->addr = (uint64_t) aBuffer;
+    sqe->len = aBytes;
+    sqe->off = (uint64_t) -1; //the file position, as read() (uio ignores it)
+    sqe->flags = aLinked ? IOSQE_IO_LINK : 0;
+    return true;
+  }
+
+  bool sUIORing::queueWrite(int aFd, void const * aBuffer, uint32_t aBytes, uint64_t aTag, bool aLinked) {
+    struct io_uring_sqe * sqe = (struct io_uring_sqe *) nextSQE(IORING_OP_WRITE, aFd, aTag);
+    if (NULL == sqe) {
+      return false;
+    }
+    sqe->addr = (uint64_t) aBuffer;
+    sqe->len = aBytes;
+    sqe->off = (uint64_t) -1;
+    sqe->flags = aLinked ? IOSQE_IO_LINK : 0;
+    return true;
+  }
+
+  bool sUIORing::queueTimeout(uint32_t aMilliseconds, uint64_t aTag) {
+    struct io_uring_sqe * sqe = (struct io_uring_sqe *) nextSQE(IORING_OP_TIMEOUT, -1, aTag);
+    if (NULL == sqe) {
+      return false;
+    }
+    //the kernel reads the timespec when it takes the entry, so one buffer does for one timeout per submit
+    timeout[0] = aMilliseconds/1000;
+    timeout[1] = (aMilliseconds%1000)*1000000;
+    sqe->addr = (uint64_t) timeout;
+    sqe->len = 1;
+    sqe->off = 0; //a pure timer, not a count of other completions
+    return true;
+  }
+
+  bool sUIORing::queueCancel(uint64_t aTarget, uint64_t aTag) {
+    struct io_uring_sqe * sqe = (struct io_uring_sqe *) nextSQE(IORING_OP_ASYNC_CANCEL, -1, aTag);
+    if (NULL == sqe) {
+      return false;
+    }
+    sqe->addr = aTarget;
+    return true;
+  }
+
+  bool sUIORing::queueTimeoutRemove(uint64_t aTarget, uint64_t aTag) {
+    struct io_uring_sqe * sqe = (struct io_uring_sqe *) nextSQE(IORING_OP_TIMEOUT_REMOVE, -1, aTag);
+    if (NULL == sqe) {
+      return false;
+    }
+    sqe->addr = aTarget;
+    return true;
+  }
+
+  int sUIORing::submit(uint32_t aWaitFor) {
+    uint32_t tail = *sqTail + sqQueued;
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+    sqQueued = 0;
+    //(entries an earlier submit left behind go too)
+    uint32_t toSubmit = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if ((0 == toSubmit) && (0 == aWaitFor)) {
+      return 0;
+    }
+    int ret = syscall(__NR_io_uring_enter, fd, toSubmit, aWaitFor, aWaitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    return (ret < 0) ? -errno : ret;
+  }
+
+  bool sUIORing::completion(uint64_t & aTag, int32_t & aResult) {
+    uint32_t head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    struct io_uring_cqe const & cqe = ((struct io_uring_cqe const *) cqes)[head & cqMask];
+    aTag = cqe.user_data;
+    aResult = cqe.res;
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+#else
+
+  int  sUIORing::setup(uint32_t) {return ENOSYS;}
+  bool sUIORing::queueRead(int, void *, uint32_t, uint64_t, bool) {return false;}
+  bool sUIORing::queueWrite(int, void const *, uint32_t, uint64_t, bool) {return false;}
+  bool sUIORing::queueTimeout(uint32_t, uint64_t) {return false;}
+  bool sUIORing::queueCancel(uint64_t, uint64_t) {return false;}
+  bool sUIORing::queueTimeoutRemove(uint64_t, uint64_t) {return false;}
+  int  sUIORing::submit(uint32_t) {return -ENOSYS;}
+  bool sUIORing::completion(uint64_t &, int32_t &) {return false;}
+
+#endif
+
+}//uioaxi namespace